@@ -0,0 +1,41 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+
+//
+// Count heap allocations, loaded with LD_PRELOAD by stfbench.
+//
+// The count is written to the file descriptor in COUNTALLOC_FD at exit.
+//
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long count;
+
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+__attribute__((destructor)) static void report(void)
+{
+    const char *fd = getenv("COUNTALLOC_FD");
+
+    if (fd)
+        dprintf(atoi(fd), "%lu\n", count);
+}
@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+//
+// Run stfjson over a file in each of it's modes, and report the throughput,
+// peak memory and allocations per item of each.
+//
+
+struct stage {
+    const char *name;
+    bool threads;           // Use a thread for each cpu.
+    const char *args[8];
+};
+
+// Each mode exercises a different part of the pipeline. The parse stage
+// converts everything but prints nothing, because no link has an empty name.
+static const struct stage kStages[] = {
+    { "parse",      false,  { "-s", "-f", "category:" } },
+    { "document",   false,  { NULL } },
+    { "stream",     false,  { "-s" } },
+    { "lines",      false,  { "-l" } },
+    { "json-c",     false,  { "-J", "-s" } },
+    { "threads",    true,   { NULL } },
+    { "index",      false,  { "-x", "-f", "category:Phone" } },
+};
+
+struct result {
+    double seconds;
+    long maxrss;            // Kilobytes.
+    unsigned long allocations;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Items are the only place {I} can appear unescaped.
+static size_t count_items(const char *filename, size_t *size)
+{
+    struct stat st;
+    size_t count = 0;
+    char *data;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) == -1 || fstat(fd, &st) != 0)
+        err(EXIT_FAILURE, "failed to open %s", filename);
+
+    *size = st.st_size;
+
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    if ((data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+        err(EXIT_FAILURE, "failed to map %s", filename);
+
+    for (char *p = data; (p = memmem(p, data + st.st_size - p, "{I}", 3)); p += 3)
+        count++;
+
+    munmap(data, st.st_size);
+    close(fd);
+    return count;
+}
+
+static void run_stage(const char *stfjson, const char *preload, const struct stage *stage, const char *threads, const char *filename, struct result *result)
+{
+    const char *argv[16] = { stfjson };
+    struct rusage usage;
+    char fdname[16];
+    double start;
+    int status;
+    int pipefd[2];
+    int argc = 1;
+    pid_t pid;
+    FILE *counts;
+
+    for (int i = 0; i < 8 && stage->args[i]; i++)
+        argv[argc++] = stage->args[i];
+
+    if (stage->threads) {
+        argv[argc++] = "-j";
+        argv[argc++] = threads;
+    }
+
+    argv[argc++] = filename;
+    argv[argc++] = NULL;
+
+    if (pipe(pipefd) != 0)
+        err(EXIT_FAILURE, "failed to create pipe");
+
+    start = now();
+
+    if ((pid = fork()) == -1)
+        err(EXIT_FAILURE, "failed to fork");
+
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        close(pipefd[0]);
+
+        if (preload) {
+            snprintf(fdname, sizeof fdname, "%d", pipefd[1]);
+            setenv("COUNTALLOC_FD", fdname, 1);
+            setenv("LD_PRELOAD", preload, 1);
+        }
+
+        execv(stfjson, (char **) argv);
+        _exit(127);
+    }
+
+    close(pipefd[1]);
+
+    if (wait4(pid, &status, 0, &usage) != pid)
+        err(EXIT_FAILURE, "failed to wait for %s", stfjson);
+
+    result->seconds = now() - start;
+    result->maxrss  = usage.ru_maxrss;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        errx(EXIT_FAILURE, "the %s stage failed", stage->name);
+
+    counts = fdopen(pipefd[0], "r");
+
+    if (fscanf(counts, "%lu", &result->allocations) != 1)
+        result->allocations = 0;
+
+    fclose(counts);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n runs] [-a countalloc.so] stfjson transfer.stf\n", name);
+    fprintf(stderr, "  -n   Run each stage this many times and keep the best, default 3.\n");
+    fprintf(stderr, "  -a   Count allocations with this library.\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *preload = NULL;
+    char threads[16];
+    size_t items, size;
+    int runs = 3;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:a:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                runs = strtol(optarg, NULL, 10);
+                break;
+            case 'a':
+                // LD_PRELOAD needs a path, not just a name.
+                if ((preload = realpath(optarg, NULL)) == NULL)
+                    err(EXIT_FAILURE, "failed to find %s", optarg);
+                break;
+            case 'h':
+                usage(*argv);
+                return 0;
+            default:
+                usage(*argv);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 2 || runs < 1) {
+        usage(*argv);
+        return EXIT_FAILURE;
+    }
+
+    snprintf(threads, sizeof threads, "%ld", sysconf(_SC_NPROCESSORS_ONLN));
+
+    items = count_items(argv[optind + 1], &size);
+
+    printf("%s: %.1f MB, %zu items\n", argv[optind + 1], size / 1048576.0, items);
+    printf("%-10s %10s %12s %12s %12s\n", "stage", "MB/s", "items/s", "peak RSS", "allocs/item");
+
+    for (size_t i = 0; i < sizeof kStages / sizeof *kStages; i++) {
+        struct result best = {0}, result;
+
+        // The index stage measures queries, so build the index first.
+        if (strcmp(kStages[i].name, "index") == 0)
+            run_stage(argv[optind], NULL, &kStages[i], threads, argv[optind + 1], &result);
+
+        for (int run = 0; run < runs; run++) {
+            run_stage(argv[optind], preload, &kStages[i], threads, argv[optind + 1], &result);
+
+            if (run == 0 || result.seconds < best.seconds)
+                best.seconds = result.seconds;
+
+            if (result.maxrss > best.maxrss)
+                best.maxrss = result.maxrss;
+
+            best.allocations = result.allocations;
+        }
+
+        printf("%-10s %10.1f %12.0f %10ld K %12.3f\n",
+               kStages[i].name,
+               size / 1048576.0 / best.seconds,
+               items / best.seconds,
+               best.maxrss,
+               items ? (double) best.allocations / items : 0.0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,948 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "../stf.h"
+
+//
+// Check that the fast paths through libstf give exactly the same results as
+// the simple ones, and measure each part of the parser.
+//
+// Every input is parsed from one buffer with the scalar tag scanner, then
+// again with each of the vector scanners, fed in random pieces, read through
+// fill(), lazily and while recovering from errors. Everything passed to the
+// callbacks is written to a log, which has to be identical each time. This
+// can check files and random mutations of them, or run under libFuzzer or
+// AFL.
+//
+// It can also run programs on each input, like the original converter and
+// stfjson, which have to print exactly the same things and exit the same way.
+//
+
+enum {
+    PARSE_BUFFER,       // stf_parse_buffer()
+    PARSE_FEED,         // stf_feed() with random pieces.
+    PARSE_FILL,         // A fill() function that adds random pieces.
+};
+
+static const char *kParseNames[] = {
+    [PARSE_BUFFER]  = "buffer",
+    [PARSE_FEED]    = "feed",
+    [PARSE_FILL]    = "fill",
+};
+
+struct variant {
+    const char *scanner;
+    int parse;
+    bool lazy;
+    bool recover;
+};
+
+// Items are only written to the log when they end, because a lazy parser
+// doesn't see the fields until then. Like the parser, the last text or note
+// wins.
+struct log {
+    FILE *out;
+    char *data;
+    size_t len;
+    FILE *links;
+    char *linkdata;
+    size_t linklen;
+    char *text;
+    char *note;
+};
+
+// A simple xorshift generator, so the same seed always does the same thing.
+static uint32_t random_number(uint64_t *seed, uint32_t max)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed % max;
+}
+
+// Mostly small pieces, so every chunk is split somewhere.
+static size_t random_piece(uint64_t *seed)
+{
+    return random_number(seed, 8) ? random_number(seed, 16) + 1 : random_number(seed, 4096) + 1;
+}
+
+// The logs are compared as strings, so the slices can't contain nuls.
+static void log_slice(FILE *out, struct stf_slice slice)
+{
+    fprintf(out, " %zu:", slice.len);
+
+    for (size_t i = 0; i < slice.len; i++) {
+        if (slice.data[i] == '\0' || slice.data[i] == '\\') {
+            fprintf(out, "\\%o", (unsigned char) slice.data[i]);
+        } else {
+            fputc(slice.data[i], out);
+        }
+    }
+}
+
+static void log_values(FILE *out, const char *name, const struct stf_slice *values, size_t count)
+{
+    fprintf(out, " %s[", name);
+
+    for (size_t i = 0; i < count; i++)
+        log_slice(out, values[i]);
+
+    fputs(" ]", out);
+}
+
+static char *copy_chunk(struct stf_context *ctx, const struct stf_chunk *chunk)
+{
+    struct stf_slice value = stf_chunk_value(&ctx->scratch, chunk);
+    char *copy;
+    size_t len;
+    FILE *out = open_memstream(&copy, &len);
+
+    log_slice(out, value);
+    fclose(out);
+    return copy;
+}
+
+static int log_header(struct stf_context *ctx, const char *timestamp)
+{
+    struct log *log = ctx->arg;
+
+    fprintf(log->out, "header %s\n", timestamp);
+    return 0;
+}
+
+static int log_category(struct stf_context *ctx, const struct stf_category *category)
+{
+    struct log *log = ctx->arg;
+    FILE *out = log->out;
+
+    fprintf(out, "category %u %d", category->id, category->complete);
+    log_slice(out, category->name);
+    log_values(out, "attributes", category->attributes, category->nattributes);
+
+    for (size_t i = 0; i < category->nfields; i++) {
+        switch (category->fields[i]) {
+            case STF_CATEGORY_NOTE:
+                fputs(" note", out);
+                log_slice(out, category->note);
+                break;
+            case STF_CATEGORY_CONDITIONS:
+                log_values(out, "conditions+", category->conditions.include, category->conditions.ninclude);
+                log_values(out, "conditions-", category->conditions.exclude, category->conditions.nexclude);
+                break;
+            case STF_CATEGORY_ACTIONS:
+                log_values(out, "actions+", category->actions.include, category->actions.ninclude);
+                log_values(out, "actions-", category->actions.exclude, category->actions.nexclude);
+                break;
+        }
+    }
+
+    fputc('\n', out);
+    return 0;
+}
+
+static void log_reset_item(struct log *log)
+{
+    if (log->links)
+        fclose(log->links);
+
+    free(log->linkdata);
+    free(log->text);
+    free(log->note);
+
+    log->links = open_memstream(&log->linkdata, &log->linklen);
+    log->text  = NULL;
+    log->note  = NULL;
+}
+
+static int log_item_begin(struct stf_context *ctx)
+{
+    log_reset_item(ctx->arg);
+    return 0;
+}
+
+static int log_item_text(struct stf_context *ctx, const struct stf_chunk *chunk)
+{
+    struct log *log = ctx->arg;
+
+    free(log->text);
+    log->text = copy_chunk(ctx, chunk);
+    return 0;
+}
+
+static int log_item_note(struct stf_context *ctx, const struct stf_chunk *chunk)
+{
+    struct log *log = ctx->arg;
+
+    free(log->note);
+    log->note = copy_chunk(ctx, chunk);
+    return 0;
+}
+
+static void mismatch(const char *what, const char *expected, const char *actual);
+
+// This is how dates were converted before the specialized parser, strptime()
+// with the escapes removed in place.
+static void reference_timestamp(struct stf_context *ctx, const struct stf_link *link, char *timestamp, size_t size)
+{
+    char *value = strndupa(link->value.data, link->value.len);
+    char *unescaped = strdupa(value);
+    struct tm parsed = {0};
+
+    for (char *p = unescaped; (*p = *value++);) {
+        if (*p != '%')
+            p++;
+        if (*p == ';')
+            unescaped = p + 1;
+    }
+
+    strptime(unescaped, kStfDateFormats[ctx->dateformat], &parsed);
+
+    if (strftime(timestamp, size, STF_JSON_DATE_FORMAT, &parsed) == 0)
+        *timestamp = '\0';
+}
+
+// Dates are converted too, a failure is logged rather than stopping.
+static int log_item_link(struct stf_context *ctx, const struct stf_link *link)
+{
+    struct log *log = ctx->arg;
+    FILE *out = log->links;
+    char timestamp[128];
+
+    fprintf(out, " link %d %u %s %s", link->type, link->id, link->name, link->shortname ? link->shortname : "-");
+
+    for (size_t i = 0; i < link->nalsomatch; i++)
+        fprintf(out, " %s", link->alsomatch[i]);
+
+    if (link->value.data) {
+        log_slice(out, link->value);
+
+        if (stf_link_timestamp(ctx, link, timestamp, sizeof timestamp) == 0) {
+            char expected[128];
+
+            reference_timestamp(ctx, link, expected, sizeof expected);
+
+            if (strcmp(expected, timestamp) != 0)
+                mismatch("the date parser", expected, timestamp);
+
+            fprintf(out, " @%s", timestamp);
+        } else {
+            fprintf(out, " !%s", ctx->error);
+            *ctx->error = '\0';
+        }
+    }
+
+    fputc('\n', out);
+    return 0;
+}
+
+static int log_item_end(struct stf_context *ctx, bool complete)
+{
+    struct log *log = ctx->arg;
+    const struct stf_item *item = &ctx->item;
+    struct stf_chunk chunk;
+    struct stf_link link;
+
+    if (ctx->lazy) {
+        for (size_t i = 0; i < item->nfields; i++) {
+            stf_item_chunk(ctx, item->fields[i] == STF_ITEM_TEXT ? &item->text : &item->note, &chunk);
+
+            if (item->fields[i] == STF_ITEM_TEXT) {
+                log_item_text(ctx, &chunk);
+            } else {
+                log_item_note(ctx, &chunk);
+            }
+        }
+
+        for (size_t i = 0; i < item->nlinks; i++) {
+            if (stf_item_link(ctx, i, &link) != 0)
+                return -1;
+
+            log_item_link(ctx, &link);
+        }
+    }
+
+    fflush(log->links);
+    fprintf(log->out, "item %d text%s note%s\n%s", complete, log->text ? log->text : "", log->note ? log->note : "", log->linkdata);
+
+    log_reset_item(log);
+    return 0;
+}
+
+static int log_comment(struct stf_context *ctx, const struct stf_chunk *chunk)
+{
+    struct log *log = ctx->arg;
+
+    fputs("comment", log->out);
+    log_slice(log->out, stf_chunk_value(&ctx->scratch, chunk));
+    fputc('\n', log->out);
+    return 0;
+}
+
+static void log_warning(struct stf_context *ctx, const char *message)
+{
+    struct log *log = ctx->arg;
+
+    fprintf(log->out, "warning %s\n", message);
+}
+
+static int log_skipped(struct stf_context *ctx, size_t offset, struct stf_slice data)
+{
+    struct log *log = ctx->arg;
+
+    fprintf(log->out, "skipped %zu %s", offset, ctx->error);
+    log_slice(log->out, data);
+    fputc('\n', log->out);
+    return 0;
+}
+
+static const struct stf_callbacks kLogCallbacks = {
+    .on_stf_header  = log_header,
+    .on_category    = log_category,
+    .on_item_begin  = log_item_begin,
+    .on_item_text   = log_item_text,
+    .on_item_note   = log_item_note,
+    .on_item_link   = log_item_link,
+    .on_item_end    = log_item_end,
+    .on_comment     = log_comment,
+    .on_warning     = log_warning,
+    .on_skipped     = log_skipped,
+};
+
+// Like reading a pipe, the buffer moves as it grows.
+struct pieces {
+    const char *data;
+    size_t len;
+    size_t pos;
+    uint64_t seed;
+    char *buffer;
+    size_t size;
+};
+
+static void fill_pieces(struct stf_input *input, void *arg)
+{
+    struct pieces *pieces = arg;
+    size_t count = random_piece(&pieces->seed);
+
+    if (count > pieces->len - pieces->pos)
+        count = pieces->len - pieces->pos;
+
+    stf_input_compact(input);
+
+    if (input->len + count > pieces->size) {
+        pieces->size    = (input->len + count) * 2;
+        pieces->buffer  = realloc(pieces->buffer, pieces->size);
+        input->data     = pieces->buffer;
+    }
+
+    memcpy(input->data + input->len, pieces->data + pieces->pos, count);
+
+    input->len  += count;
+    pieces->pos += count;
+    input->eof   = pieces->pos == pieces->len;
+}
+
+// Returns the log, which has to be freed.
+static char *run_variant(const struct variant *variant, const char *data, size_t len, uint64_t seed)
+{
+    struct stf_context ctx;
+    struct log log = {0};
+    struct pieces pieces = { .data = data, .len = len, .seed = seed };
+    int result = 0;
+
+    stf_context_init(&ctx, &kLogCallbacks, &log);
+
+    if (!stf_use_scan_tag(&ctx.input, variant->scanner))
+        return NULL;
+
+    log.out = open_memstream(&log.data, &log.len);
+
+    log_reset_item(&log);
+
+    ctx.lazy    = variant->lazy;
+    ctx.recover = variant->recover;
+
+    switch (variant->parse) {
+        case PARSE_BUFFER:
+            result = stf_parse_buffer(&ctx, data, len);
+            break;
+        case PARSE_FEED:
+            for (size_t pos = 0, count; pos < len && result == 0; pos += count) {
+                count  = random_piece(&seed);
+                count  = count < len - pos ? count : len - pos;
+                result = stf_feed(&ctx, data + pos, count);
+            }
+
+            if (result == 0)
+                result = stf_finish(&ctx);
+            break;
+        case PARSE_FILL:
+            ctx.input.fill      = fill_pieces;
+            ctx.input.fillarg   = &pieces;
+            ctx.input.eof       = len == 0;
+            result = stf_parse(&ctx);
+            break;
+    }
+
+    fprintf(log.out, "result %d %s\n", result, result ? ctx.error : "");
+
+    stf_context_destroy(&ctx);
+    log_reset_item(&log);
+    fclose(log.links);
+    fclose(log.out);
+    free(log.linkdata);
+    free(pieces.buffer);
+    return log.data;
+}
+
+// The result is always the last line.
+static bool log_succeeded(const char *log)
+{
+    size_t len = strlen(log);
+
+    return len >= 10 && strcmp(log + len - 10, "result 0 \n") == 0 && (len == 10 || log[len - 11] == '\n');
+}
+
+static const char *failure = "stffuzz-failure.stf";
+
+// The input being checked, so it can be saved.
+static const char *input;
+static size_t inputlen;
+
+static void mismatch(const char *what, const char *expected, const char *actual)
+{
+    FILE *out;
+
+    fprintf(stderr, "%s is different:\n", what);
+    fprintf(stderr, "  expected %.*s\n", (int) strcspn(expected, "\n"), expected);
+    fprintf(stderr, "  actual   %.*s\n", (int) strcspn(actual, "\n"), actual);
+
+    if (failure && (out = fopen(failure, "w"))) {
+        fwrite(input, 1, inputlen, out);
+        fclose(out);
+        fprintf(stderr, "the input was saved to %s\n", failure);
+    }
+
+    // This is how libFuzzer and AFL know something went wrong.
+    abort();
+}
+
+// Where the line with the first difference starts.
+static size_t first_difference(const char *expected, size_t explen, const char *actual, size_t actlen)
+{
+    size_t line = 0;
+
+    for (size_t i = 0; i < explen && i < actlen && expected[i] == actual[i]; i++) {
+        if (expected[i] == '\n')
+            line = i + 1;
+    }
+
+    return line;
+}
+
+// Show the first line of the logs that's different.
+static void compare_logs(const struct variant *variant, const char *expected, const char *actual)
+{
+    char what[128];
+    size_t line;
+
+    if (strcmp(expected, actual) == 0)
+        return;
+
+    line = first_difference(expected, strlen(expected), actual, strlen(actual));
+
+    snprintf(what, sizeof what, "the %s scanner, %s%s%s", variant->scanner, kParseNames[variant->parse], variant->lazy ? ", lazy" : "", variant->recover ? ", recovering" : "");
+
+    mismatch(what, expected + line, actual + line);
+}
+
+// The programs to compare, the first is the reference. Each is run by the
+// shell with the input on stdin.
+#define MAX_COMMANDS 8
+
+static const char *commands[MAX_COMMANDS];
+static int ncommands;
+
+struct output {
+    int status;
+    char *data[2];      // What was written to stdout and stderr.
+    size_t len[2];
+};
+
+static char *read_output(int fd, size_t *len)
+{
+    char *data = malloc((*len = lseek(fd, 0, SEEK_END)) + 1);
+
+    if (data == NULL || pread(fd, data, *len, 0) != (ssize_t) *len)
+        err(EXIT_FAILURE, "failed to read output");
+
+    data[*len] = '\0';
+    close(fd);
+    return data;
+}
+
+// Errors and warnings start with the name of the program, which is different.
+static void remove_names(const char *command, char *data, size_t *len)
+{
+    const char *name = strrchr(command, '/') ? strrchr(command, '/') + 1 : command;
+    size_t namelen = strcspn(name, " ");
+    size_t out = 0;
+
+    for (size_t i = 0; i < *len; ) {
+        size_t end = i;
+
+        while (end < *len && data[end] != '\n')
+            end++;
+
+        if (end - i > namelen + 1 && strncmp(data + i, name, namelen) == 0 && strncmp(data + i + namelen, ": ", 2) == 0)
+            i += namelen + 2;
+
+        end += end < *len;
+
+        memmove(data + out, data + i, end - i);
+        out += end - i;
+        i = end;
+    }
+
+    *len = out;
+    data[out] = '\0';
+}
+
+static void run_command(const char *command, const char *data, size_t len, struct output *output)
+{
+    int fds[3];
+    pid_t pid;
+
+    for (int i = 0; i < 3; i++) {
+        if ((fds[i] = memfd_create("stffuzz", 0)) == -1)
+            err(EXIT_FAILURE, "failed to create a file for %s", command);
+    }
+
+    if (len && write(fds[0], data, len) != (ssize_t) len)
+        err(EXIT_FAILURE, "failed to write the input for %s", command);
+
+    lseek(fds[0], 0, SEEK_SET);
+
+    if ((pid = fork()) == -1)
+        err(EXIT_FAILURE, "failed to run %s", command);
+
+    if (pid == 0) {
+        for (int i = 0; i < 3; i++)
+            dup2(fds[i], i);
+
+        execl("/bin/sh", "sh", "-c", command, NULL);
+        _exit(127);
+    }
+
+    if (waitpid(pid, &output->status, 0) == -1)
+        err(EXIT_FAILURE, "failed to wait for %s", command);
+
+    close(fds[0]);
+
+    for (int i = 0; i < 2; i++)
+        output->data[i] = read_output(fds[i + 1], &output->len[i]);
+
+    remove_names(command, output->data[1], &output->len[1]);
+}
+
+static void describe_status(int status, char *description, size_t size)
+{
+    if (WIFEXITED(status)) {
+        snprintf(description, size, "exit %d", WEXITSTATUS(status));
+    } else {
+        snprintf(description, size, "signal %d", WTERMSIG(status));
+    }
+}
+
+// The shell exits with 128 and the signal number when a command is killed.
+static bool crashed(int status)
+{
+    return !WIFEXITED(status) || WEXITSTATUS(status) >= 128;
+}
+
+// The reference might crash on some inputs, there's nothing to compare then.
+static void compare_commands(const char *data, size_t len)
+{
+    static const char *kStreams[] = { "stdout", "stderr" };
+    struct output expected, actual;
+    char what[128];
+
+    run_command(commands[0], data, len, &expected);
+
+    for (int i = 1; i < ncommands && !crashed(expected.status); i++) {
+        run_command(commands[i], data, len, &actual);
+
+        for (int j = 0; j < 2; j++) {
+            if (expected.len[j] != actual.len[j] || memcmp(expected.data[j], actual.data[j], actual.len[j]) != 0) {
+                size_t line = first_difference(expected.data[j], expected.len[j], actual.data[j], actual.len[j]);
+
+                snprintf(what, sizeof what, "the %s of %s", kStreams[j], commands[i]);
+                mismatch(what, expected.data[j] + line, actual.data[j] + line);
+            }
+
+            free(actual.data[j]);
+        }
+
+        if (actual.status != expected.status) {
+            char status[2][32];
+
+            describe_status(expected.status, status[0], sizeof status[0]);
+            describe_status(actual.status, status[1], sizeof status[1]);
+
+            snprintf(what, sizeof what, "the exit status of %s", commands[i]);
+            mismatch(what, status[0], status[1]);
+        }
+    }
+
+    free(expected.data[0]);
+    free(expected.data[1]);
+}
+
+// Compare every variant against the simplest, then with recovery against the
+// simplest recovering parser. Lazy parsers only stop at invalid links when
+// the item ends, so they're only compared if there was no error.
+static void check_input(const char *data, size_t len, uint64_t seed)
+{
+    struct variant simple = { .scanner = "scalar", .parse = PARSE_BUFFER };
+    char *expected[2];
+    bool succeeded;
+
+    input       = data;
+    inputlen    = len;
+    expected[0] = run_variant(&simple, data, len, seed);
+    succeeded   = log_succeeded(expected[0]);
+
+    simple.recover = true;
+    expected[1] = run_variant(&simple, data, len, seed);
+
+    if (succeeded)
+        compare_logs(&simple, expected[0], expected[1]);
+
+    for (const char **scanner = kStfScanTagNames; *scanner; scanner++) {
+        for (int parse = PARSE_BUFFER; parse <= PARSE_FILL; parse++) {
+            for (int mode = 0; mode < 3; mode++) {
+                struct variant variant = { *scanner, parse, mode == 1, mode == 2 };
+                const char *compare = expected[variant.recover];
+                char *actual;
+
+                if (variant.lazy && !succeeded)
+                    continue;
+
+                if ((actual = run_variant(&variant, data, len, seed)) == NULL)
+                    continue;
+
+                compare_logs(&variant, compare, actual);
+
+                free(actual);
+            }
+        }
+    }
+
+    free(expected[0]);
+    free(expected[1]);
+
+    if (ncommands)
+        compare_commands(data, len);
+}
+
+#ifdef STFFUZZ_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    failure = NULL;
+    check_input((const char *) data, size, size + 1);
+    return 0;
+}
+#else
+// The kinds of damage an export might have, most near tags.
+static const char *kMutations[] = {
+    "{", "}", "{ ", ";", "\\", "/", "@|", "#|", "%", "\n",
+    "{STF}", "{STF}01/02/03;04:05:06;002", "{d}", "{d}7", "{C}", "{C}Name\\",
+    "{I}", "{T}", "{N}", "{!}", "{.}", "{r}", "{;}", "{p}", "{a}", "{+}",
+    "{-}", "{S}", "{F}", "{}", "{C}\\When@|12/31/1999 11:59pm",
+};
+
+// Mutate part of the input, so each check is small.
+static void check_mutations(const char *data, size_t len, int count, uint64_t *seed)
+{
+    char *buffer = malloc(65536 * 2 + 1024);
+
+    for (int i = 0; i < count; i++) {
+        size_t window = len < 65536 ? len : random_number(seed, 65536) + 1;
+        size_t offset = random_number(seed, len - window + 1);
+        size_t size = window;
+        int changes = random_number(seed, 8) + 1;
+
+        memcpy(buffer, data + offset, window);
+
+        for (int j = 0; j < changes && size < 65536 * 2; j++) {
+            size_t pos = random_number(seed, size + 1);
+            size_t n = random_number(seed, 64) + 1;
+            const char *insert = kMutations[random_number(seed, sizeof kMutations / sizeof *kMutations)];
+
+            switch (random_number(seed, 4)) {
+                // Insert something that looks like a tag.
+                case 0:
+                    memmove(buffer + pos + strlen(insert), buffer + pos, size - pos);
+                    memcpy(buffer + pos, insert, strlen(insert));
+                    size += strlen(insert);
+                    break;
+                // Delete a few characters.
+                case 1:
+                    n = n < size - pos ? n : size - pos;
+                    memmove(buffer + pos, buffer + pos + n, size - pos - n);
+                    size -= n;
+                    break;
+                // Replace one, sometimes with any byte at all.
+                case 2:
+                    if (pos < size)
+                        buffer[pos] = random_number(seed, 4) ? *insert : (char) random_number(seed, 256);
+                    break;
+                // Cut it short.
+                case 3:
+                    size = pos;
+                    break;
+            }
+        }
+
+        check_input(buffer, size, *seed);
+    }
+
+    free(buffer);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Each kernel is measured with as little else as possible around it.
+enum {
+    KERNEL_TOKENIZE,    // Just stf_read_chunk().
+    KERNEL_VALUES,      // And decode every value.
+    KERNEL_PARSE,       // The state machine, including links.
+    KERNEL_LAZY,        // Indexing items.
+    KERNEL_LINKS,       // Indexing, then parsing every link.
+    KERNEL_DATES,       // Parsing, and converting every date.
+};
+
+static const char *kKernelNames[] = {
+    [KERNEL_TOKENIZE]   = "tokenize",
+    [KERNEL_VALUES]     = "values",
+    [KERNEL_PARSE]      = "parse",
+    [KERNEL_LAZY]       = "lazy",
+    [KERNEL_LINKS]      = "links",
+    [KERNEL_DATES]      = "dates",
+};
+
+static int bench_links(struct stf_context *ctx, bool complete)
+{
+    struct stf_link link;
+
+    (void) complete;
+
+    for (size_t i = 0; i < ctx->item.nlinks; i++) {
+        if (stf_item_link(ctx, i, &link) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int bench_dates(struct stf_context *ctx, const struct stf_link *link)
+{
+    char timestamp[128];
+
+    if (link->type == STF_LINK_DATE && link->value.data)
+        stf_link_timestamp(ctx, link, timestamp, sizeof timestamp);
+
+    return 0;
+}
+
+static const struct stf_callbacks kLinkCallbacks = { .on_item_end = bench_links };
+static const struct stf_callbacks kDateCallbacks = { .on_item_link = bench_dates };
+
+static void run_tokenizer(int kernel, const char *scanner, const char *data, size_t len)
+{
+    struct stf_input input = { .data = (char *) data, .len = len, .eof = true };
+    struct stf_chunk chunk;
+    struct stf_arena arena = {0};
+
+    stf_use_scan_tag(&input, scanner);
+
+    while (stf_read_chunk(&input, &chunk) == 0) {
+        if (kernel == KERNEL_VALUES) {
+            stf_chunk_value(&arena, &chunk);
+            stf_arena_reset(&arena);
+        }
+    }
+
+    stf_arena_destroy(&arena);
+}
+
+static void run_parser(int kernel, const char *scanner, const char *data, size_t len)
+{
+    struct stf_context ctx;
+
+    switch (kernel) {
+        case KERNEL_LINKS:
+            stf_context_init(&ctx, &kLinkCallbacks, NULL);
+            break;
+        case KERNEL_DATES:
+            stf_context_init(&ctx, &kDateCallbacks, NULL);
+            break;
+        default:
+            stf_context_init(&ctx, NULL, NULL);
+            break;
+    }
+
+    ctx.lazy = kernel == KERNEL_LAZY || kernel == KERNEL_LINKS;
+
+    stf_use_scan_tag(&ctx.input, scanner);
+
+    if (stf_parse_buffer(&ctx, data, len) != 0)
+        errx(EXIT_FAILURE, "the %s kernel failed, %s", kKernelNames[kernel], ctx.error);
+
+    stf_context_destroy(&ctx);
+}
+
+static double run_kernel(int kernel, const char *scanner, const char *data, size_t len, int runs)
+{
+    double best = 0;
+
+    for (int run = 0; run < runs; run++) {
+        double start = now();
+
+        if (kernel <= KERNEL_VALUES) {
+            run_tokenizer(kernel, scanner, data, len);
+        } else {
+            run_parser(kernel, scanner, data, len);
+        }
+
+        if (run == 0 || now() - start < best)
+            best = now() - start;
+    }
+
+    return len / 1048576.0 / best;
+}
+
+// The tokenizer is measured with every scanner, then everything else with
+// the best one.
+static void bench_kernels(const char *data, size_t len, int runs)
+{
+    struct stf_input input = {0};
+    const char *best = "scalar";
+    char name[64];
+
+    printf("%-16s %10s\n", "kernel", "MB/s");
+
+    for (const char **scanner = kStfScanTagNames; *scanner; scanner++) {
+        if (!stf_use_scan_tag(&input, *scanner))
+            continue;
+
+        snprintf(name, sizeof name, "%s/%s", kKernelNames[KERNEL_TOKENIZE], *scanner);
+        printf("%-16s %10.1f\n", name, run_kernel(KERNEL_TOKENIZE, *scanner, data, len, runs));
+
+        best = *scanner;
+    }
+
+    for (int kernel = KERNEL_VALUES; kernel <= KERNEL_DATES; kernel++)
+        printf("%-16s %10.1f\n", kKernelNames[kernel], run_kernel(kernel, best, data, len, runs));
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-m mutations] [-r seed] [-c command ...] [-b] [-n runs] transfer.stf ...\n", name);
+    fprintf(stderr, "  -m   Also check this many random mutations of each file.\n");
+    fprintf(stderr, "  -c   Run each command on every input, the first is the reference.\n");
+    fprintf(stderr, "  -r   Random seed for the mutations and pieces, default 1.\n");
+    fprintf(stderr, "  -b   Measure each kernel instead of checking.\n");
+    fprintf(stderr, "  -n   Run each kernel this many times and keep the best, default 3.\n");
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t seed = 1;
+    int mutations = 0;
+    int runs = 3;
+    bool bench = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:r:c:bn:h")) != -1) {
+        switch (opt) {
+            case 'm':
+                mutations = strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'c':
+                if (ncommands == MAX_COMMANDS)
+                    errx(EXIT_FAILURE, "too many commands");
+
+                commands[ncommands++] = optarg;
+                break;
+            case 'b':
+                bench = true;
+                break;
+            case 'n':
+                runs = strtol(optarg, NULL, 10);
+                break;
+            case 'h':
+                usage(*argv);
+                return 0;
+            default:
+                usage(*argv);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (argc == optind || seed == 0 || runs < 1 || ncommands == 1) {
+        usage(*argv);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        struct stat st;
+        char *data = NULL;
+        int fd;
+
+        if ((fd = open(argv[i], O_RDONLY)) == -1 || fstat(fd, &st) != 0)
+            err(EXIT_FAILURE, "failed to open %s", argv[i]);
+
+        if (st.st_size && (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+            err(EXIT_FAILURE, "failed to map %s", argv[i]);
+
+        if (bench) {
+            printf("%s: %.1f MB\n", argv[i], st.st_size / 1048576.0);
+            bench_kernels(data, st.st_size, runs);
+        } else {
+            check_input(data, st.st_size, seed);
+
+            if (st.st_size)
+                check_mutations(data, st.st_size, mutations, &seed);
+
+            printf("%s: %d mutations, all the same\n", argv[i], mutations);
+        }
+
+        if (data)
+            munmap(data, st.st_size);
+
+        close(fd);
+    }
+
+    return 0;
+}
+#endif
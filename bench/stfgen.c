@@ -0,0 +1,277 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <err.h>
+
+//
+// Generate a synthetic STF export for benchmarking.
+//
+// The output is made from the same kinds of things a real Agenda export has,
+// several {STF} blocks with categories, conditions and actions, followed by
+// items with notes and category links, including dates in every format.
+//
+// It can also be damaged in the ways stfjson -r has to recover from, or have
+// categories defined between the items, which Agenda doesn't do but stfjson
+// still has to handle.
+//
+
+static const char *kWords[] = {
+    "buy", "milk", "call", "bob", "report", "meeting", "review", "budget",
+    "lunch", "project", "status", "agenda", "draft", "send", "invoice",
+    "50%", "a/b", "quote\"d", "back\\slash", "x;y", "{ T} tag", "{ I}tem",
+};
+
+static const char *kMonthNames[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+};
+
+static const char *kDateCategories[] = {
+    "\\When", "\\Entry", "\\Done",
+};
+
+static uint64_t seed = 1;
+static long written;
+static int damage;
+static bool late;
+
+// The output might be a pipe, so count how much has been written.
+static void out(const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    written += vprintf(format, ap);
+    va_end(ap);
+}
+
+// A simple xorshift generator, so the same seed always gives the same file.
+static uint32_t random_number(uint32_t max)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed % max;
+}
+
+static bool random_chance(int percent)
+{
+    return random_number(100) < (uint32_t) percent;
+}
+
+static void print_words(int count)
+{
+    for (int i = 0; i < count; i++)
+        out("%s%s", i ? " " : "", kWords[random_number(sizeof kWords / sizeof *kWords)]);
+}
+
+// Print a date in one of the formats from Appendix B-7.
+static void print_date(int dateformat)
+{
+    int year   = 1980 + random_number(50);
+    int month  = 1 + random_number(12);
+    int day    = 1 + random_number(28);
+    int hour   = random_number(24);
+    int minute = random_number(60);
+    int hour12 = hour % 12 ? hour % 12 : 12;
+    const char *ampm = hour < 12 ? "am" : "pm";
+    const char *name = kMonthNames[month - 1];
+
+    switch (dateformat) {
+        case 1:
+        case 2:  out("%02d/%02d/%04d %02d:%02d", month, day, year, hour, minute); break;
+        case 3:  out("%02d.%02d.%04d %02d:%02d", day, month, year, hour, minute); break;
+        case 4:  out("%04d-%02d-%02d %02d:%02d", year, month, day, hour, minute); break;
+        case 5:  out("%02d-%s %02d:%02d", day, name, hour, minute); break;
+        case 6:  out("%02d-%s-%04d %02d:%02d", day, name, year, hour, minute); break;
+        case 7:  out("%02d/%02d/%04d %02d:%02d%s", month, day, year, hour12, minute, ampm); break;
+        case 8:  out("%02d/%02d/%04d %02d:%02d%s", day, month, year, hour12, minute, ampm); break;
+        case 9:  out("%02d.%02d.%04d %02d:%02d%s", day, month, year, hour12, minute, ampm); break;
+        case 10: out("%04d-%02d-%02d %02d:%02d%s", year, month, day, hour12, minute, ampm); break;
+        case 11: out("%02d-%s %02d:%02d%s", day, name, hour12, minute, ampm); break;
+        case 12: out("%02d-%s-%04d %02d:%02d%s", day, name, year, hour12, minute, ampm); break;
+    }
+}
+
+static void print_category(int number)
+{
+    out("{C}Category%d;C%d\\", number, number);
+
+    for (int i = random_number(3); i > 0; i--)
+        out("{r}%s{;}", random_chance(50) ? "AC" : "PEA");
+
+    if (random_chance(50)) {
+        out("{F}");
+        print_words(1 + random_number(20));
+    }
+
+    if (random_chance(40)) {
+        out("{p}");
+        for (int i = random_number(4); i > 0; i--)
+            out("{C}Project%d\\{%c}", random_number(20), random_chance(50) ? '+' : '-');
+        out("{;}");
+    }
+
+    if (random_chance(30)) {
+        out("{a}");
+        for (int i = random_number(4); i > 0; i--)
+            out("{C}Category%d\\{%c}", random_number(number + 1), random_chance(50) ? '+' : '-');
+        out("{;}");
+    }
+
+    out("{.}\n");
+}
+
+static void print_item(int dateformat)
+{
+    out("{I}\n{T}");
+    print_words(1 + random_number(10));
+    out("\n");
+
+    for (int i = random_number(6); i > 0; i--) {
+        switch (random_number(6)) {
+            case 0:
+            case 1:
+                out("{C}%s@|", kDateCategories[random_number(3)]);
+                print_date(dateformat);
+                break;
+            case 2:
+                out("{C}Project%d\\", random_number(20));
+                break;
+            case 3:
+                out("{C}Project%d;P%d;Also%d\\", random_number(20), random_number(20), random_number(5));
+                break;
+            case 4:
+                out("{C}Status;St/");
+                break;
+            case 5:
+                out("{C}Phone|");
+                break;
+        }
+        out("\n");
+    }
+
+    if (random_chance(30)) {
+        out("{N}");
+        print_words(1 + random_number(60));
+        out("\n");
+    }
+
+    out("{!}\n");
+}
+
+// Something that can't be parsed, each of these is skipped differently.
+// The {d} in a broken item is skipped with it, so it mustn't be applied.
+static void print_damage(int dateformat)
+{
+    switch (random_number(5)) {
+        case 0:
+            out("{I}{T}damaged{X}{d}%d{!}\n", 1 + (dateformat + random_number(11)) % 12);
+            break;
+        case 1:
+            out("{T}stray text in the root\n");
+            break;
+        case 2:
+            out("{d}99\n");
+            break;
+        case 3:
+            out("{C}Damaged\\{T}not a category field{.}\n");
+            break;
+        case 4:
+            out("{I}{T}damaged{C};{!}\n");
+            break;
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-l] [-s megabytes] [-b blocks] [-r seed] [-d percent]\n", name);
+    fprintf(stderr, "  -s   Approximate size of the output, default 64.\n");
+    fprintf(stderr, "  -b   Number of concatenated {STF} blocks, default 4.\n");
+    fprintf(stderr, "  -r   Random seed, default 1.\n");
+    fprintf(stderr, "  -d   Damage about this many items, and a few headers.\n");
+    fprintf(stderr, "  -l   Define some categories after items.\n");
+}
+
+int main(int argc, char **argv)
+{
+    long size = 64;
+    int blocks = 4;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:b:r:d:lh")) != -1) {
+        switch (opt) {
+            case 's':
+                size = strtol(optarg, NULL, 10);
+                break;
+            case 'b':
+                blocks = strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                seed = strtoull(optarg, NULL, 10) | 1;
+                break;
+            case 'd':
+                damage = strtol(optarg, NULL, 10);
+                break;
+            case 'l':
+                late = true;
+                break;
+            case 'h':
+                usage(*argv);
+                return 0;
+            default:
+                usage(*argv);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (size <= 0 || blocks <= 0)
+        errx(EXIT_FAILURE, "size and blocks must be positive");
+
+    if (damage < 0 || damage > 100)
+        errx(EXIT_FAILURE, "damage must be a percentage");
+
+    for (int block = 0; block < blocks; block++) {
+        int dateformat = 1 + block % 12;
+
+        // The whole block is skipped, up to the next header.
+        if (damage && random_chance(25))
+            out("{STF}damaged header\n");
+
+        out("{STF}%02d/%02d/%02d;%02d:%02d:%02d;002\n",
+               1 + random_number(12),
+               1 + random_number(28),
+               random_number(100),
+               random_number(24),
+               random_number(60),
+               random_number(60));
+        out("{d}%d\n", dateformat);
+        out("{S}Synthetic export %d of %d\n", block + 1, blocks);
+
+        for (int i = 0; i < 16 + (int) random_number(16); i++)
+            print_category(i);
+
+        // Each block is about the same size, so stop when this one is full.
+        while (written < (size << 20) * (block + 1) / blocks) {
+            // Move through every date format.
+            if (random_chance(1)) {
+                dateformat = 1 + random_number(12);
+                out("{d}%d\n", dateformat);
+            }
+
+            if (damage && random_chance(damage))
+                print_damage(dateformat);
+
+            if (late && random_chance(1))
+                print_category(32 + random_number(16));
+
+            print_item(dateformat);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,930 @@
+#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "stf.h"
+
+//
+// Convert the JSON that stfjson prints back into STF, so that changes made
+// with other tools can be imported into Agenda again.
+//
+// The input is read as a stream of tokens and the STF is written as each
+// value arrives, so nothing bigger than a single category or link is kept.
+//
+
+#define READ_BLOCK_SIZE (1 << 20)
+#define WRITE_BLOCK_SIZE (1 << 20)
+
+// Ids index a table, and Agenda can't have anywhere near this many
+// categories.
+#define MAX_CATEGORY_ID (1 << 24)
+
+struct strbuf {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+// Make room for len more bytes and a terminator.
+static void strbuf_reserve(struct strbuf *buf, size_t len)
+{
+    if (buf->size - buf->len >= len + 1)
+        return;
+
+    while (buf->size - buf->len < len + 1)
+        buf->size = buf->size ? buf->size * 2 : 256;
+
+    if ((buf->data = realloc(buf->data, buf->size)) == NULL)
+        err(EXIT_FAILURE, "failed to allocate buffer");
+}
+
+static void strbuf_append(struct strbuf *buf, const char *data, size_t len)
+{
+    strbuf_reserve(buf, len);
+
+    memcpy(buf->data + buf->len, data, len);
+
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+static void strbuf_puts(struct strbuf *buf, const char *s)
+{
+    strbuf_append(buf, s, strlen(s));
+}
+
+static void strbuf_putc(struct strbuf *buf, char c)
+{
+    strbuf_reserve(buf, 1);
+
+    buf->data[buf->len++] = c;
+    buf->data[buf->len] = '\0';
+}
+
+static void strbuf_reset(struct strbuf *buf)
+{
+    buf->len = 0;
+
+    if (buf->data)
+        *buf->data = '\0';
+}
+
+// The JSON is read in blocks, only the unread part of the buffer is kept.
+struct json_reader {
+    int fd;
+    const char *filename;
+    char *data;
+    size_t pos;
+    size_t len;
+    size_t size;
+    bool eof;
+    size_t line;                // For error messages.
+    struct strbuf string;       // The last string or key read, decoded.
+};
+
+static void __attribute__((noreturn, format(printf, 2, 3))) json_error(struct json_reader *reader, const char *format, ...)
+{
+    char message[256];
+    va_list ap;
+
+    va_start(ap, format);
+    vsnprintf(message, sizeof message, format, ap);
+    va_end(ap);
+
+    errx(EXIT_FAILURE, "%s:%zu: %s", reader->filename, reader->line, message);
+}
+
+// Make sure there's at least one unread byte, unless we reach EOF.
+static bool json_fill(struct json_reader *reader)
+{
+    ssize_t result;
+
+    while (reader->pos == reader->len && !reader->eof) {
+        reader->pos = reader->len = 0;
+
+        do {
+            result = read(reader->fd, reader->data, reader->size);
+        } while (result == -1 && errno == EINTR);
+
+        if (result == -1)
+            err(EXIT_FAILURE, "failed to read %s", reader->filename);
+
+        reader->eof = result == 0;
+        reader->len = result;
+    }
+
+    return reader->pos < reader->len;
+}
+
+// Returns the next character after any whitespace without consuming it, or
+// EOF.
+static int json_peek(struct json_reader *reader)
+{
+    while (json_fill(reader)) {
+        const char *p = reader->data + reader->pos;
+        const char *end = reader->data + reader->len;
+
+        // Pretty printed JSON is mostly indentation.
+        for (; p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'); p++) {
+            if (*p == '\n')
+                reader->line++;
+        }
+
+        reader->pos = p - reader->data;
+
+        if (p < end)
+            return (unsigned char) *p;
+    }
+
+    return EOF;
+}
+
+static bool json_consume(struct json_reader *reader, int c)
+{
+    if (json_peek(reader) != c)
+        return false;
+
+    reader->pos++;
+    return true;
+}
+
+static void json_expect(struct json_reader *reader, int c)
+{
+    if (!json_consume(reader, c))
+        json_error(reader, "expected '%c'", c);
+}
+
+static int json_getc(struct json_reader *reader)
+{
+    if (!json_fill(reader))
+        json_error(reader, "unexpected end of input in a string");
+
+    return (unsigned char) reader->data[reader->pos++];
+}
+
+static unsigned json_hex(struct json_reader *reader)
+{
+    unsigned value = 0;
+
+    for (int i = 0; i < 4; i++) {
+        int c = json_getc(reader);
+
+        if (c >= '0' && c <= '9') {
+            value = value * 16 + c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            value = value * 16 + c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            value = value * 16 + c - 'A' + 10;
+        } else {
+            json_error(reader, "invalid unicode escape");
+        }
+    }
+
+    return value;
+}
+
+static void json_utf8(struct strbuf *buf, unsigned code)
+{
+    char utf8[4];
+    size_t len;
+
+    if (code < 0x80) {
+        utf8[0] = code;
+        len = 1;
+    } else if (code < 0x800) {
+        utf8[0] = 0xc0 | code >> 6;
+        utf8[1] = 0x80 | (code & 0x3f);
+        len = 2;
+    } else if (code < 0x10000) {
+        utf8[0] = 0xe0 | code >> 12;
+        utf8[1] = 0x80 | (code >> 6 & 0x3f);
+        utf8[2] = 0x80 | (code & 0x3f);
+        len = 3;
+    } else {
+        utf8[0] = 0xf0 | code >> 18;
+        utf8[1] = 0x80 | (code >> 12 & 0x3f);
+        utf8[2] = 0x80 | (code >> 6 & 0x3f);
+        utf8[3] = 0x80 | (code & 0x3f);
+        len = 4;
+    }
+
+    strbuf_append(buf, utf8, len);
+}
+
+// Read a string into reader->string, decoding any escapes.
+static const char *json_string(struct json_reader *reader)
+{
+    struct strbuf *string = &reader->string;
+    unsigned code, low;
+    int c;
+
+    json_expect(reader, '"');
+    strbuf_reset(string);
+
+    while (true) {
+        const char *p, *end;
+
+        if (!json_fill(reader))
+            json_error(reader, "unexpected end of input in a string");
+
+        // Copy everything up to the next quote or escape in one go.
+        p   = reader->data + reader->pos;
+        end = reader->data + reader->len;
+
+        while (p < end && *p != '"' && *p != '\\')
+            p++;
+
+        strbuf_append(string, reader->data + reader->pos, p - reader->data - reader->pos);
+
+        reader->pos = p - reader->data;
+
+        if (p == end)
+            continue;
+
+        if (json_getc(reader) == '"')
+            break;
+
+        switch (c = json_getc(reader)) {
+            case '"':
+            case '\\':
+            case '/':
+                strbuf_putc(string, c);
+                break;
+            case 'b': strbuf_putc(string, '\b'); break;
+            case 'f': strbuf_putc(string, '\f'); break;
+            case 'n': strbuf_putc(string, '\n'); break;
+            case 'r': strbuf_putc(string, '\r'); break;
+            case 't': strbuf_putc(string, '\t'); break;
+            case 'u':
+                code = json_hex(reader);
+
+                // Characters outside the BMP are a surrogate pair.
+                if (code >= 0xd800 && code < 0xdc00) {
+                    if (json_getc(reader) != '\\' || json_getc(reader) != 'u')
+                        json_error(reader, "invalid surrogate pair");
+
+                    if ((low = json_hex(reader)) < 0xdc00 || low >= 0xe000)
+                        json_error(reader, "invalid surrogate pair");
+
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                }
+
+                json_utf8(string, code);
+                break;
+            default:
+                json_error(reader, "invalid escape '\\%c' in a string", c);
+        }
+    }
+
+    return string->data;
+}
+
+// The literals and numbers are never needed, just their extent.
+static void json_scalar(struct json_reader *reader)
+{
+    size_t len = 0;
+
+    json_peek(reader);
+
+    while (json_fill(reader) && reader->data[reader->pos] && strchr("0123456789+-.eEabcdfilnrstu", reader->data[reader->pos])) {
+        reader->pos++;
+        len++;
+    }
+
+    if (len == 0)
+        json_error(reader, "expected a value");
+}
+
+static long json_integer(struct json_reader *reader)
+{
+    bool negative = json_consume(reader, '-');
+    long value = 0;
+
+    if (json_peek(reader) < '0' || json_peek(reader) > '9')
+        json_error(reader, "expected a number");
+
+    while (json_fill(reader) && reader->data[reader->pos] >= '0' && reader->data[reader->pos] <= '9') {
+        int digit = reader->data[reader->pos++] - '0';
+
+        if (value > (LONG_MAX - digit) / 10)
+            json_error(reader, "number is too large");
+
+        value = value * 10 + digit;
+    }
+
+    return negative ? -value : value;
+}
+
+// Iterate over the members of an object, the key is left in
+// reader->string.
+static bool json_member(struct json_reader *reader, bool *first)
+{
+    if (*first) {
+        json_expect(reader, '{');
+        *first = false;
+
+        if (json_consume(reader, '}'))
+            return false;
+    } else {
+        if (json_consume(reader, '}'))
+            return false;
+
+        json_expect(reader, ',');
+    }
+
+    json_string(reader);
+    json_expect(reader, ':');
+    return true;
+}
+
+static bool json_element(struct json_reader *reader, bool *first)
+{
+    if (*first) {
+        json_expect(reader, '[');
+        *first = false;
+
+        return !json_consume(reader, ']');
+    }
+
+    if (json_consume(reader, ']'))
+        return false;
+
+    json_expect(reader, ',');
+    return true;
+}
+
+static bool json_key(const struct json_reader *reader, const char *key)
+{
+    return strcmp(reader->string.data, key) == 0;
+}
+
+static void json_skip(struct json_reader *reader)
+{
+    bool first = true;
+
+    switch (json_peek(reader)) {
+        case '{':
+            while (json_member(reader, &first))
+                json_skip(reader);
+            break;
+        case '[':
+            while (json_element(reader, &first))
+                json_skip(reader);
+            break;
+        case '"':
+            json_string(reader);
+            break;
+        default:
+            json_scalar(reader);
+            break;
+    }
+}
+
+// In normalized output from stfjson -n, only the first link to each category
+// in a block has it's names and type, so they're kept here by id.
+struct described_link {
+    bool described;
+    const char *symbol;
+    struct strbuf names;        // Already escaped.
+};
+
+// The STF is built up in a buffer and written out in large blocks.
+struct stf_writer {
+    struct strbuf out;
+    int dateformat;
+    bool header;                // Whether a block has been started.
+    long block;                 // The index of the current block, for lines.
+    struct strbuf timestamp;
+    struct strbuf name;         // The parts of a category or link that can't
+    struct strbuf fields;       // be written until it's complete.
+    struct strbuf shortname;
+    struct strbuf alsomatch;
+    struct strbuf value;
+    struct strbuf names;
+    struct described_link *described;
+    size_t ndescribed;
+};
+
+static void writer_flush(struct stf_writer *writer, bool force)
+{
+    ssize_t result;
+    size_t written = 0;
+
+    if (writer->out.len < WRITE_BLOCK_SIZE && !force)
+        return;
+
+    while (written < writer->out.len) {
+        if ((result = write(STDOUT_FILENO, writer->out.data + written, writer->out.len - written)) == -1) {
+            if (errno == EINTR)
+                continue;
+
+            err(EXIT_FAILURE, "failed to write output");
+        }
+
+        written += result;
+    }
+
+    strbuf_reset(&writer->out);
+}
+
+static void write_tag(struct strbuf *buf, const char *tag)
+{
+    strbuf_putc(buf, STF_OPEN_TAG);
+    strbuf_puts(buf, tag);
+    strbuf_putc(buf, STF_CLOSE_TAG);
+}
+
+// Any open tag characters in a value have to be escaped with a space.
+static void write_text(struct strbuf *buf, const char *text, size_t len)
+{
+    const char *tag;
+
+    while ((tag = memchr(text, STF_OPEN_TAG, len))) {
+        strbuf_append(buf, text, tag - text + 1);
+        strbuf_putc(buf, STF_ESCAPE_TAG);
+
+        len  -= tag - text + 1;
+        text  = tag + 1;
+    }
+
+    strbuf_append(buf, text, len);
+}
+
+// Values in a link also use % to escape symbols, Appendix B-13.
+static void write_symbols(struct strbuf *buf, const char *text)
+{
+    for (; *text; text++) {
+        if (strchr("%;", *text))
+            strbuf_putc(buf, '%');
+
+        strbuf_putc(buf, *text);
+    }
+}
+
+// Convert a STF_JSON_DATE_FORMAT timestamp with another format.
+static void convert_timestamp(struct json_reader *reader, const char *timestamp, const char *format, char *result, size_t size)
+{
+    struct tm date = {0};
+    int year, end = 0;
+
+    // Dates that Agenda couldn't parse have a zero day, so this is more
+    // lenient than strptime() would be.
+    sscanf(timestamp, "%4d-%2d-%2dT%2d:%2d:%2dZ%n", &year, &date.tm_mon, &date.tm_mday,
+            &date.tm_hour, &date.tm_min, &date.tm_sec, &end);
+
+    if (end == 0 || timestamp[end] != '\0' || date.tm_mon < 1 || date.tm_mon > 12)
+        json_error(reader, "invalid timestamp '%s'", timestamp);
+
+    // The year has to be read back the same way, headers only have two
+    // digits for 1969 to 2068.
+    if (strstr(format, "%y") ? year < 1969 || year > 2068 : year < 0)
+        json_error(reader, "the year of timestamp '%s' can't be written in STF", timestamp);
+
+    date.tm_year = year - 1900;
+    date.tm_mon -= 1;
+
+    if (strftime(result, size, format, &date) == 0)
+        json_error(reader, "failed to format timestamp '%s'", timestamp);
+}
+
+// Appendix B-5, the date format in effect is written after every header.
+static void write_header(struct stf_writer *writer, struct json_reader *reader)
+{
+    char header[64];
+    char format[8];
+
+    convert_timestamp(reader, writer->timestamp.data, "%m/%d/%y;%H:%M:%S;002", header, sizeof header);
+    snprintf(format, sizeof format, "%d", writer->dateformat);
+
+    write_tag(&writer->out, "STF");
+    strbuf_puts(&writer->out, header);
+    strbuf_putc(&writer->out, '\n');
+    write_tag(&writer->out, "d");
+    strbuf_puts(&writer->out, format);
+    strbuf_putc(&writer->out, '\n');
+
+    // Category ids are only valid in the block they're from.
+    for (size_t i = 0; i < writer->ndescribed; i++)
+        writer->described[i].described = false;
+
+    writer->header = true;
+}
+
+static void require_header(struct stf_writer *writer, struct json_reader *reader)
+{
+    if (!writer->header)
+        json_error(reader, "a block needs a timestamp before any categories or items");
+}
+
+// The {p} and {a} sections are lists of category names, each followed by
+// {+} or {-}.
+static void convert_assignments(struct stf_writer *writer, struct json_reader *reader, const char *tag)
+{
+    bool first = true;
+
+    write_tag(&writer->fields, tag);
+
+    while (json_member(reader, &first)) {
+        const char *type = json_key(reader, "include") ? "+" : json_key(reader, "exclude") ? "-" : NULL;
+        bool next = true;
+
+        if (type == NULL) {
+            json_skip(reader);
+            continue;
+        }
+
+        while (json_element(reader, &next)) {
+            json_string(reader);
+            write_tag(&writer->fields, "C");
+            write_text(&writer->fields, reader->string.data, reader->string.len);
+            write_tag(&writer->fields, type);
+        }
+    }
+
+    write_tag(&writer->fields, ";");
+}
+
+// The name has to be written first, but the fields keep their order.
+static void convert_category(struct stf_writer *writer, struct json_reader *reader)
+{
+    bool first = true;
+
+    strbuf_reset(&writer->name);
+    strbuf_reset(&writer->fields);
+
+    while (json_member(reader, &first)) {
+        if (json_key(reader, "name")) {
+            json_string(reader);
+            strbuf_append(&writer->name, reader->string.data, reader->string.len);
+        } else if (json_key(reader, "attributes")) {
+            bool next = true;
+
+            while (json_element(reader, &next)) {
+                json_string(reader);
+                write_tag(&writer->fields, "r");
+                write_text(&writer->fields, reader->string.data, reader->string.len);
+                write_tag(&writer->fields, ";");
+            }
+        } else if (json_key(reader, "note")) {
+            json_string(reader);
+            write_tag(&writer->fields, "F");
+            write_text(&writer->fields, reader->string.data, reader->string.len);
+        } else if (json_key(reader, "conditions")) {
+            convert_assignments(writer, reader, "p");
+        } else if (json_key(reader, "actions")) {
+            convert_assignments(writer, reader, "a");
+        } else {
+            json_skip(reader);
+        }
+    }
+
+    if (writer->name.len == 0)
+        json_error(reader, "a category must have a name");
+
+    write_tag(&writer->out, "C");
+    write_text(&writer->out, writer->name.data, writer->name.len);
+    strbuf_append(&writer->out, writer->fields.data, writer->fields.len);
+    write_tag(&writer->out, ".");
+    strbuf_putc(&writer->out, '\n');
+}
+
+// Category Type Symbols (Appendix B-11), in the order of enum stf_link_type.
+static const char *kLinkTypeSymbols[] = {
+    [STF_LINK_STANDARD]     = "\\",
+    [STF_LINK_EXCLUSIVE]    = "/",
+    [STF_LINK_DATE]         = "@|",
+    [STF_LINK_UNINDEXED]    = "|",
+    [STF_LINK_NUMERIC]      = "#|",
+};
+
+// Find the names and type of a category by id in a normalized link.
+static struct described_link *find_described(struct stf_writer *writer, struct json_reader *reader, long id)
+{
+    if (id < 0 || id > MAX_CATEGORY_ID)
+        json_error(reader, "invalid category id %ld", id);
+
+    if ((size_t) id >= writer->ndescribed) {
+        size_t size = writer->ndescribed ? writer->ndescribed : 256;
+
+        while (size <= (size_t) id)
+            size *= 2;
+
+        if ((writer->described = realloc(writer->described, size * sizeof *writer->described)) == NULL)
+            err(EXIT_FAILURE, "failed to allocate category ids");
+
+        memset(writer->described + writer->ndescribed, 0, (size - writer->ndescribed) * sizeof *writer->described);
+
+        writer->ndescribed = size;
+    }
+
+    return &writer->described[id];
+}
+
+// A link is the names separated by semicolons, then the type symbol and any
+// value. The names are exactly as they appeared in the original STF. If the
+// link has an id, anything missing is the same as the first link to it.
+static void convert_link(struct stf_writer *writer, struct json_reader *reader)
+{
+    const char *symbol = NULL;
+    struct described_link *described = NULL;
+    bool first = true;
+    long id = -1;
+    char date[64];
+
+    strbuf_reset(&writer->name);
+    strbuf_reset(&writer->shortname);
+    strbuf_reset(&writer->alsomatch);
+    strbuf_reset(&writer->value);
+
+    while (json_member(reader, &first)) {
+        if (json_key(reader, "id")) {
+            id = json_integer(reader);
+        } else if (json_key(reader, "type")) {
+            json_string(reader);
+
+            symbol = NULL;
+
+            for (size_t i = 0; i < sizeof kLinkTypeSymbols / sizeof *kLinkTypeSymbols; i++) {
+                if (json_key(reader, kStfLinkTypeNames[i]))
+                    symbol = kLinkTypeSymbols[i];
+            }
+
+            if (symbol == NULL)
+                json_error(reader, "unknown link type '%s'", reader->string.data);
+
+        } else if (json_key(reader, "name")) {
+            json_string(reader);
+            strbuf_append(&writer->name, reader->string.data, reader->string.len);
+        } else if (json_key(reader, "shortname")) {
+            json_string(reader);
+            strbuf_append(&writer->shortname, reader->string.data, reader->string.len);
+        } else if (json_key(reader, "alsomatch")) {
+            bool next = true;
+
+            while (json_element(reader, &next)) {
+                json_string(reader);
+                strbuf_putc(&writer->alsomatch, ';');
+                strbuf_append(&writer->alsomatch, reader->string.data, reader->string.len);
+            }
+        } else if (json_key(reader, "value")) {
+            json_string(reader);
+            convert_timestamp(reader, reader->string.data, kStfDateFormats[writer->dateformat], date, sizeof date);
+            write_symbols(&writer->value, date);
+        } else {
+            json_skip(reader);
+        }
+    }
+
+    if (id != -1)
+        described = find_described(writer, reader, id);
+
+    strbuf_reset(&writer->names);
+
+    if (writer->name.len) {
+        write_text(&writer->names, writer->name.data, writer->name.len);
+
+        if (writer->shortname.len) {
+            strbuf_putc(&writer->names, ';');
+            write_text(&writer->names, writer->shortname.data, writer->shortname.len);
+        }
+
+        write_text(&writer->names, writer->alsomatch.data ? writer->alsomatch.data : "", writer->alsomatch.len);
+    } else if (described && described->described) {
+        strbuf_append(&writer->names, described->names.data, described->names.len);
+    } else {
+        json_error(reader, "a category link must have a name");
+    }
+
+    if (symbol == NULL)
+        symbol = described && described->described ? described->symbol : kLinkTypeSymbols[STF_LINK_STANDARD];
+
+    if (described && !described->described) {
+        described->described = true;
+        described->symbol = symbol;
+        strbuf_reset(&described->names);
+        strbuf_append(&described->names, writer->names.data, writer->names.len);
+    }
+
+    write_tag(&writer->out, "C");
+    strbuf_append(&writer->out, writer->names.data, writer->names.len);
+    strbuf_puts(&writer->out, symbol);
+    strbuf_append(&writer->out, writer->value.data ? writer->value.data : "", writer->value.len);
+    strbuf_putc(&writer->out, '\n');
+}
+
+// Items are written as they're read, the links are always first in the JSON
+// but it doesn't matter where they are in the STF.
+static void convert_item(struct stf_writer *writer, struct json_reader *reader)
+{
+    bool first = true;
+
+    write_tag(&writer->out, "I");
+    strbuf_putc(&writer->out, '\n');
+
+    while (json_member(reader, &first)) {
+        if (json_key(reader, "categories")) {
+            bool next = true;
+
+            while (json_element(reader, &next))
+                convert_link(writer, reader);
+        } else if (json_key(reader, "text") || json_key(reader, "note")) {
+            write_tag(&writer->out, json_key(reader, "text") ? "T" : "N");
+            json_string(reader);
+            write_text(&writer->out, reader->string.data, reader->string.len);
+            strbuf_putc(&writer->out, '\n');
+        } else {
+            json_skip(reader);
+        }
+    }
+
+    write_tag(&writer->out, "!");
+    strbuf_putc(&writer->out, '\n');
+}
+
+static void convert_timestamp_member(struct stf_writer *writer, struct json_reader *reader)
+{
+    json_string(reader);
+    strbuf_reset(&writer->timestamp);
+    strbuf_append(&writer->timestamp, reader->string.data, reader->string.len);
+}
+
+// A document is an array of {STF} blocks, each with a timestamp, then an
+// array of categories and an array of items.
+static void convert_document(struct stf_writer *writer, struct json_reader *reader)
+{
+    bool first = true;
+
+    while (json_element(reader, &first)) {
+        bool member = true;
+
+        writer->header = false;
+
+        while (json_member(reader, &member)) {
+            bool next = true;
+
+            if (json_key(reader, "timestamp")) {
+                convert_timestamp_member(writer, reader);
+                write_header(writer, reader);
+            } else if (json_key(reader, "categories")) {
+                require_header(writer, reader);
+
+                while (json_element(reader, &next)) {
+                    convert_category(writer, reader);
+                    writer_flush(writer, false);
+                }
+            } else if (json_key(reader, "items")) {
+                require_header(writer, reader);
+
+                while (json_element(reader, &next)) {
+                    convert_item(writer, reader);
+                    writer_flush(writer, false);
+                }
+            } else {
+                json_skip(reader);
+            }
+        }
+    }
+}
+
+// Each line is an object with the index and timestamp of the block, then a
+// category or item. A new block starts whenever the index changes.
+static void convert_lines(struct stf_writer *writer, struct json_reader *reader)
+{
+    while (json_peek(reader) != EOF) {
+        bool first = true;
+        long block = -1;
+
+        while (json_member(reader, &first)) {
+            if (json_key(reader, "stf")) {
+                block = json_integer(reader);
+            } else if (json_key(reader, "timestamp")) {
+                convert_timestamp_member(writer, reader);
+            } else if (json_key(reader, "category") || json_key(reader, "item")) {
+                bool item = json_key(reader, "item");
+
+                if (!writer->header || block != writer->block) {
+                    if (writer->timestamp.len == 0)
+                        json_error(reader, "a line needs a timestamp before the category or item");
+
+                    write_header(writer, reader);
+                    writer->block = block;
+                }
+
+                if (item) {
+                    convert_item(writer, reader);
+                } else {
+                    convert_category(writer, reader);
+                }
+            } else {
+                json_skip(reader);
+            }
+        }
+
+        strbuf_reset(&writer->timestamp);
+        writer_flush(writer, false);
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-d format] [transfer.json]\n", name);
+    fprintf(stderr, "  -d   Write dates in this format from Appendix B-6, 1 to 12.\n");
+    fprintf(stderr, "The input can be a document or JSON Lines from stfjson.\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct json_reader reader = {0};
+    struct stf_writer writer = {0};
+    int opt;
+
+    writer.dateformat = 4;
+
+    while ((opt = getopt(argc, argv, "d:h")) != -1) {
+        switch (opt) {
+            case 'd':
+                writer.dateformat = strtol(optarg, NULL, 10);
+
+                if (writer.dateformat < 1 || writer.dateformat > 12)
+                    errx(EXIT_FAILURE, "the date format must be from 1 to 12");
+                break;
+            case 'h':
+                usage(*argv);
+                return 0;
+            default:
+                usage(*argv);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind > 1) {
+        usage(*argv);
+        return EXIT_FAILURE;
+    }
+
+    reader.fd       = STDIN_FILENO;
+    reader.filename = "stdin";
+    reader.line     = 1;
+    reader.size     = READ_BLOCK_SIZE;
+
+    if ((reader.data = malloc(reader.size)) == NULL)
+        err(EXIT_FAILURE, "failed to allocate buffer");
+
+    if (optind < argc) {
+        reader.filename = argv[optind];
+
+        if ((reader.fd = open(argv[optind], O_RDONLY)) == -1)
+            err(EXIT_FAILURE, "failed to open %s", argv[optind]);
+    }
+
+    // Lines start with an object, a document with an array.
+    switch (json_peek(&reader)) {
+        case '[':
+            convert_document(&writer, &reader);
+
+            if (json_peek(&reader) != EOF)
+                json_error(&reader, "unexpected data after the document");
+            break;
+        case '{':
+            convert_lines(&writer, &reader);
+            break;
+        case EOF:
+            break;
+        default:
+            json_error(&reader, "expected a document or JSON Lines");
+    }
+
+    writer_flush(&writer, true);
+
+    free(reader.data);
+    free(reader.string.data);
+    free(writer.out.data);
+    free(writer.timestamp.data);
+    free(writer.name.data);
+    free(writer.fields.data);
+    free(writer.shortname.data);
+    free(writer.alsomatch.data);
+    free(writer.value.data);
+    free(writer.names.data);
+
+    for (size_t i = 0; i < writer.ndescribed; i++)
+        free(writer.described[i].names.data);
+
+    free(writer.described);
+
+    if (reader.fd != STDIN_FILENO)
+        close(reader.fd);
+
+    return 0;
+}
@@ -0,0 +1,1898 @@
+#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <ctype.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#elif defined(__aarch64__)
+# include <arm_neon.h>
+#endif
+
+#include "stf.h"
+
+//
+// The STF parser from stfjson, as a library. See stf.h.
+//
+// Author: taviso@gmail.com
+// Date: October, 2020
+//
+
+// The table from Appendix B-7, translated into strptime formats.
+// NOTE: The manual incorrectly claims 2-digit years are used.
+const char * kStfDateFormats[] = {
+    NULL,                // 0
+    "%m/%d/%Y %H:%M",    // 1
+    "%m/%d/%Y %H:%M",    // 2
+    "%d.%m.%Y %H:%M",    // 3
+    "%Y-%m-%d %H:%M",    // 4
+    "%d-%b %H:%M",       // 5
+    "%d-%b-%Y %H:%M",    // 6
+    "%m/%d/%Y %I:%M%p",  // 7
+    "%d/%m/%Y %I:%M%p",  // 8
+    "%d.%m.%Y %I:%M%p",  // 9
+    "%Y-%m-%d %I:%M%p",  // 10
+    "%d-%b %I:%M%p",     // 11
+    "%d-%b-%Y %I:%M%p",  // 12
+};
+
+// These are the tags from Appendix B-4
+// Documented
+// {d}      Specified a date format, such as MM/DD/YY
+// {C}      Beginning of a category specification (the category and family with
+//          any associated notes)
+// {D}      Done date
+// {F}      Beginning of a category note
+// {E}      Entry date
+// {G}      Name of the note file for the category
+// {I}      Beginning of an item specification (the item and associated
+//          categories, and notes)
+// {N}      Beginning of an item note
+// {O}      Name of the note file for an item
+// {S}      Beginning of comment text to be ignored when imported
+// {STF}    Header that begins a structured file
+// {T}      Beginning of the text of an item
+// {W}      When date
+// {.}      End of a category specification
+// {!}      End of an item specification
+
+// Undocumented
+// { ...    Escaped STF tag, remove the space then emit verbatim.
+// {r}      Category attribute?
+//          AC      - Apply Conditions?
+//          PEA     - Protected?
+// {;}      End of attribute/link.
+// {p}      Category Assignment Conditions
+// {a}      Category Assignment Action
+// {+}      Category Include
+// {-}      Category Exclude
+
+const char *kStfTagNames[STF_TAG_COUNT] = {
+    [STF_TAG_UNKNOWN]       = "?",
+    [STF_TAG_STF]           = "STF",
+    [STF_TAG_DATEFMT]       = "d",
+    [STF_TAG_CATEGORY]      = "C",
+    [STF_TAG_DONE]          = "D",
+    [STF_TAG_CATNOTE]       = "F",
+    [STF_TAG_ENTRY]         = "E",
+    [STF_TAG_CATNOTEFILE]   = "G",
+    [STF_TAG_ITEM]          = "I",
+    [STF_TAG_NOTE]          = "N",
+    [STF_TAG_NOTEFILE]      = "O",
+    [STF_TAG_COMMENT]       = "S",
+    [STF_TAG_TEXT]          = "T",
+    [STF_TAG_WHEN]          = "W",
+    [STF_TAG_ATTRIBUTE]     = "r",
+    [STF_TAG_CONDITIONS]    = "p",
+    [STF_TAG_ACTIONS]       = "a",
+    [STF_TAG_END]           = ";",
+    [STF_TAG_INCLUDE]       = "+",
+    [STF_TAG_EXCLUDE]       = "-",
+    [STF_TAG_END_CATEGORY]  = ".",
+    [STF_TAG_END_ITEM]      = "!",
+};
+
+// Category Type Symbols (Appendix B-11)
+//  \       Standard category
+//  /       Exclusive
+//  |       Unindexed (Note: manual says ¦, but all samples use |)
+//  #|      Numeric
+//  @|      Date
+//
+// Note that as described in Appendix B-13, Agenda uses % as an escape
+// character for literal symbols.
+
+const char *kStfLinkTypeNames[] = {
+    [STF_LINK_STANDARD]     = "standard",
+    [STF_LINK_EXCLUSIVE]    = "exclusive",
+    [STF_LINK_DATE]         = "date",
+    [STF_LINK_UNINDEXED]    = "unindexed",
+    [STF_LINK_NUMERIC]      = "numeric",
+};
+
+// Time is only measured if the caller asked for it.
+static uint64_t stf_clock(const struct stf_counters *counters)
+{
+    struct timespec ts;
+
+    if (counters == NULL || !counters->timing)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#define ARENA_BLOCK_SIZE (64 << 10)
+
+// Returns NULL if a new block is needed and it can't be allocated.
+void *stf_arena_alloc(struct stf_arena *arena, size_t size)
+{
+    struct stf_arena_block *block = arena->head;
+    void *result;
+
+    size = (size + 7) & ~7;
+
+    if (block == NULL || block->size - block->used < size) {
+        struct stf_arena_block **reuse = &arena->free;
+
+        // Reuse the first block from before the last reset that's big enough.
+        while (*reuse && (*reuse)->size < size)
+            reuse = &(*reuse)->next;
+
+        if ((block = *reuse)) {
+            *reuse = block->next;
+        } else {
+            size_t blocksize = ARENA_BLOCK_SIZE;
+
+            // Large blocks grow geometrically, so that a slightly larger
+            // value next time can still reuse it.
+            while (blocksize < size)
+                blocksize *= 2;
+
+            if ((block = malloc(sizeof *block + blocksize)) == NULL)
+                return NULL;
+
+            block->size = blocksize;
+            arena->blocks++;
+        }
+
+        block->used = 0;
+        block->next = arena->head;
+        arena->head = block;
+    }
+
+    result = block->data + block->used;
+    block->used += size;
+    return result;
+}
+
+char *stf_arena_strndup(struct stf_arena *arena, const char *s, size_t len)
+{
+    char *result = stf_arena_alloc(arena, len + 1);
+
+    if (result == NULL)
+        return NULL;
+
+    memcpy(result, s, len);
+
+    result[len] = '\0';
+    return result;
+}
+
+void stf_arena_reset(struct stf_arena *arena)
+{
+    while (arena->head) {
+        struct stf_arena_block *block = arena->head;
+        arena->head = block->next;
+        block->next = arena->free;
+        arena->free = block;
+    }
+}
+
+void stf_arena_destroy(struct stf_arena *arena)
+{
+    stf_arena_reset(arena);
+
+    while (arena->free) {
+        struct stf_arena_block *block = arena->free;
+        arena->free = block->next;
+        free(block);
+    }
+}
+
+static enum stf_tag intern_tag(const char *tag, size_t len)
+{
+    if (len == 3 && memcmp(tag, "STF", 3) == 0)
+        return STF_TAG_STF;
+
+    // All the others are a single character.
+    if (len != 1)
+        return STF_TAG_UNKNOWN;
+
+    switch (*tag) {
+        case 'd': return STF_TAG_DATEFMT;
+        case 'C': return STF_TAG_CATEGORY;
+        case 'D': return STF_TAG_DONE;
+        case 'F': return STF_TAG_CATNOTE;
+        case 'E': return STF_TAG_ENTRY;
+        case 'G': return STF_TAG_CATNOTEFILE;
+        case 'I': return STF_TAG_ITEM;
+        case 'N': return STF_TAG_NOTE;
+        case 'O': return STF_TAG_NOTEFILE;
+        case 'S': return STF_TAG_COMMENT;
+        case 'T': return STF_TAG_TEXT;
+        case 'W': return STF_TAG_WHEN;
+        case 'r': return STF_TAG_ATTRIBUTE;
+        case 'p': return STF_TAG_CONDITIONS;
+        case 'a': return STF_TAG_ACTIONS;
+        case ';': return STF_TAG_END;
+        case '+': return STF_TAG_INCLUDE;
+        case '-': return STF_TAG_EXCLUDE;
+        case '.': return STF_TAG_END_CATEGORY;
+        case '!': return STF_TAG_END_ITEM;
+    }
+
+    return STF_TAG_UNKNOWN;
+}
+
+// Returns the value of a chunk with any escaped tags decoded. If that
+// required rewriting the value, the result is allocated from the arena.
+struct stf_slice stf_chunk_value(struct stf_arena *arena, const struct stf_chunk *chunk)
+{
+    struct stf_slice result = chunk->value;
+    char *buf;
+    size_t len;
+
+    if (!chunk->escaped)
+        return result;
+
+    if ((buf = stf_arena_alloc(arena, chunk->value.len + 1)) == NULL) {
+        result.data = NULL;
+        result.len  = 0;
+        return result;
+    }
+
+    // Every tag character in the value is an escape, just remove the space
+    // following it. It may have been trimmed if it was the last character.
+    len = 0;
+
+    for (const char *p = chunk->value.data, *end = p + chunk->value.len, *tag; p < end; p = tag) {
+        tag = memchr(p, STF_OPEN_TAG, end - p);
+        tag = tag ? tag + 1 : end;
+
+        memcpy(buf + len, p, tag - p);
+        len += tag - p;
+
+        if (tag < end && *tag == STF_ESCAPE_TAG)
+            tag++;
+    }
+
+    buf[len] = '\0';
+
+    result.data = buf;
+    result.len  = len;
+    return result;
+}
+
+// Returns a nul-terminated copy of the value of a chunk allocated from the
+// arena, for the few places that need one, or NULL if it couldn't be.
+static char *chunk_string(struct stf_arena *arena, const struct stf_chunk *chunk)
+{
+    struct stf_slice value = stf_chunk_value(arena, chunk);
+
+    if (chunk->escaped && value.data == NULL)
+        return NULL;
+
+    return stf_arena_strndup(arena, value.data ? value.data : "", value.len);
+}
+
+// Find the next tag in [p, end), skipping over any escaped open tags. A tag
+// at end - 1 is returned because it can't be checked, the caller must look
+// at the next character when it's available. Sets *escaped if an escape was
+// skipped along the way.
+typedef const char *(*scan_tag_t)(const char *p, const char *end, bool *escaped);
+
+static const char *scan_tag_scalar(const char *p, const char *end, bool *escaped)
+{
+    while ((p = memchr(p, STF_OPEN_TAG, end - p))) {
+        if (p + 1 == end || p[1] != STF_ESCAPE_TAG)
+            return p;
+
+        *escaped = true;
+        p += 2;
+
+        if (p >= end)
+            break;
+    }
+
+    return end;
+}
+
+// The vector versions find all the open tags in a stride, and remove the ones
+// followed by an escape, so escaped data doesn't need another call.
+static const char *scan_tag_match(const char *p, uint64_t tags, uint64_t escapes, bool *escaped)
+{
+    uint64_t match = tags & ~escapes;
+
+    // Were any escapes skipped before the match?
+    if (escapes & (match ? (match & -match) - 1 : ~0ULL))
+        *escaped = true;
+
+    return match ? p + __builtin_ctzll(match) : NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static const char *scan_tag_sse2(const char *p, const char *end, bool *escaped)
+{
+    const __m128i open = _mm_set1_epi8(STF_OPEN_TAG);
+    const __m128i escape = _mm_set1_epi8(STF_ESCAPE_TAG);
+    const char *match;
+
+    // The stride includes one character of lookahead.
+    for (; end - p > 16; p += 16) {
+        __m128i data = _mm_loadu_si128((const __m128i *) p);
+        __m128i next = _mm_loadu_si128((const __m128i *) (p + 1));
+        uint64_t tags = _mm_movemask_epi8(_mm_cmpeq_epi8(data, open));
+        uint64_t escapes = tags & _mm_movemask_epi8(_mm_cmpeq_epi8(next, escape));
+
+        if ((match = scan_tag_match(p, tags, escapes, escaped)))
+            return match;
+    }
+
+    return scan_tag_scalar(p, end, escaped);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_tag_avx2(const char *p, const char *end, bool *escaped)
+{
+    const __m256i open = _mm256_set1_epi8(STF_OPEN_TAG);
+    const __m256i escape = _mm256_set1_epi8(STF_ESCAPE_TAG);
+    const char *match;
+
+    for (; end - p > 32; p += 32) {
+        __m256i data = _mm256_loadu_si256((const __m256i *) p);
+        __m256i next = _mm256_loadu_si256((const __m256i *) (p + 1));
+        uint64_t tags = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(data, open));
+        uint64_t escapes = tags & (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(next, escape));
+
+        if ((match = scan_tag_match(p, tags, escapes, escaped)))
+            return match;
+    }
+
+    return scan_tag_sse2(p, end, escaped);
+}
+#elif defined(__aarch64__)
+static const char *scan_tag_neon(const char *p, const char *end, bool *escaped)
+{
+    const uint8x16_t open = vdupq_n_u8(STF_OPEN_TAG);
+    const uint8x16_t escape = vdupq_n_u8(STF_ESCAPE_TAG);
+    const char *match;
+
+    for (; end - p > 16; p += 16) {
+        uint8x16_t data = vld1q_u8((const uint8_t *) p);
+        uint8x16_t next = vld1q_u8((const uint8_t *) p + 1);
+        uint8x16_t tags = vceqq_u8(data, open);
+        uint8x16_t escapes = vandq_u8(tags, vceqq_u8(next, escape));
+
+        // Narrow each byte to a nibble, then take one bit per nibble.
+        uint64_t tagmask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(tags), 4)), 0);
+        uint64_t escmask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(escapes), 4)), 0);
+
+        tagmask &= 0x1111111111111111ULL;
+        escmask &= 0x1111111111111111ULL;
+
+        if ((match = scan_tag_match(p, tagmask, escmask, escaped)))
+            return p + (match - p) / 4;
+    }
+
+    return scan_tag_scalar(p, end, escaped);
+}
+#endif
+
+// The best tag scanner this cpu supports is chosen once, and used by any
+// input that doesn't ask for another.
+static scan_tag_t best_scan_tag = scan_tag_scalar;
+
+static pthread_once_t scan_tag_once = PTHREAD_ONCE_INIT;
+
+static void choose_scan_tag(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        best_scan_tag = scan_tag_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        best_scan_tag = scan_tag_sse2;
+    }
+#elif defined(__aarch64__)
+    best_scan_tag = scan_tag_neon;
+#endif
+}
+
+const char *kStfScanTagNames[] = {
+    "scalar",
+#if defined(__x86_64__) || defined(__i386__)
+    "sse2",
+    "avx2",
+#elif defined(__aarch64__)
+    "neon",
+#endif
+    NULL,
+};
+
+bool stf_use_scan_tag(struct stf_input *input, const char *name)
+{
+    // The cpu has to be checked first.
+    pthread_once(&scan_tag_once, choose_scan_tag);
+
+    if (strcmp(name, "scalar") == 0) {
+        input->scan_tag = scan_tag_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    } else if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        input->scan_tag = scan_tag_sse2;
+    } else if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        input->scan_tag = scan_tag_avx2;
+#elif defined(__aarch64__)
+    } else if (strcmp(name, "neon") == 0) {
+        input->scan_tag = scan_tag_neon;
+#endif
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+// Make sure at least count unread bytes are buffered, unless we reach EOF.
+// Returns the number of unread bytes available.
+static size_t input_fill(struct stf_input *input, size_t count)
+{
+    // Without a fill function, wait for more to be fed.
+    while (input->len - input->pos < count && !input->eof && input->fill)
+        input->fill(input, input->fillarg);
+
+    return input->len - input->pos;
+}
+
+int stf_read_chunk(struct stf_input *input, struct stf_chunk *chunk)
+{
+    struct stf_token *token = &input->token;
+    uint64_t start = stf_clock(input->counters);
+    size_t tagoff, taglen;
+    size_t valoff, valend;
+    bool comment;
+    const char *p, *end, *run;
+    int state;
+
+    if (input->scan_tag == NULL) {
+        pthread_once(&scan_tag_once, choose_scan_tag);
+        input->scan_tag = best_scan_tag;
+    }
+
+    if (token->state == STF_CHUNK_NONE) {
+        // Everything before the tag is a comment.
+        token->state    = STF_CHUNK_COMMENT;
+
+        // Initialize everything to zero.
+        token->tagoff   = 0;
+        token->taglen   = 0;
+        token->valoff   = SIZE_MAX;
+        token->valend   = 0;
+        token->comment  = false;
+
+        memset(&token->chunk, 0, sizeof token->chunk);
+
+        // The previous chunk is no longer needed.
+        input->mark = input->pos;
+    }
+
+    // Carry on from wherever the input ran out last time.
+    state   = token->state;
+    tagoff  = token->tagoff;
+    taglen  = token->taglen;
+    valoff  = token->valoff;
+    valend  = token->valend;
+    comment = token->comment;
+    *chunk  = token->chunk;
+
+    while (state != STF_CHUNK_END) {
+        // Make sure there's some input available.
+        if (input_fill(input, 1) == 0)
+            break;
+
+        p   = input->data + input->pos;
+        end = input->data + input->len;
+
+        switch (state) {
+            // If anything appears before a tag, then it is a comment.
+            case STF_CHUNK_COMMENT:
+
+                // Just ignore any leading whitespace.
+                if (isspace((unsigned char) *p)) {
+                    input->mark = ++input->pos;
+                    continue;
+                }
+
+                // OK, a tag is being opened, start reading it.
+                if (*p == STF_OPEN_TAG) {
+                    tagoff = ++input->pos - input->mark;
+                    state  = STF_CHUNK_TAG;
+                    break;
+                }
+
+                // OK, this comment has actual content, fake a comment tag.
+                state     = STF_CHUNK_DATA;
+                comment   = true;
+                chunk->id = STF_TAG_COMMENT;
+
+                // fallthrough
+            case STF_CHUNK_DATA:
+
+                // Discard leading whitespace.
+                if (valoff == SIZE_MAX) {
+                    while (p < end && isspace((unsigned char) *p))
+                        p++;
+
+                    input->pos = p - input->data;
+
+                    if (p == end)
+                        break;
+
+                    valoff = input->pos - input->mark;
+                }
+
+                // Skip everything up to the next tag in one go.
+                run = input->scan_tag(p, end, &chunk->escaped);
+
+                input->pos = run - input->data;
+
+                // Need more data to find the end of this chunk.
+                if (run == end)
+                    break;
+
+                // If the first character was an escape, this is not a tag,
+                // which can't be known until the next character arrives.
+                if (input_fill(input, 2) < 2 && !input->eof)
+                    goto more;
+
+                if (input->len - input->pos >= 2 && input->data[input->pos + 1] == STF_ESCAPE_TAG) {
+                    chunk->escaped = true;
+                    input->pos += 2;
+                    break;
+                }
+
+                // This is the start of a new tag, therefore the end of our
+                // data, leave it for the next chunk.
+                state  = STF_CHUNK_END;
+                valend = input->pos - input->mark;
+                break;
+            case STF_CHUNK_TAG:
+                // Check if we've finished reading the tagname.
+                if ((run = memchr(p, STF_CLOSE_TAG, end - p)) == NULL) {
+                    input->pos = input->len;
+                    break;
+                }
+
+                taglen    = run - input->data - input->mark - tagoff;
+                input->pos = run - input->data + 1;
+                state     = STF_CHUNK_DATA;
+
+                // The caller is warned about these.
+                if (!taglen)
+                    break;
+
+                // Tags end at a NUL, like they always have.
+                chunk->id = intern_tag(input->data + input->mark + tagoff,
+                                       strnlen(input->data + input->mark + tagoff, taglen));
+
+                // There are some tags that don't have data, just end.
+                switch (chunk->id) {
+                    case STF_TAG_END:           // UNDOCUMENTED; End of attribute.
+                    case STF_TAG_INCLUDE:       // UNDOCUMENTED; Category relationship.
+                    case STF_TAG_EXCLUDE:       // UNDOCUMENTED; Category relationship.
+                    case STF_TAG_END_CATEGORY:  // End of a category specification.
+                    case STF_TAG_END_ITEM:      // End of an item specification.
+                        state = STF_CHUNK_END;
+                        break;
+                    default:
+                        break;
+                }
+                break;
+        }
+    }
+
+    if (state != STF_CHUNK_END) {
+        if (!input->eof)
+            goto more;
+
+        // If the input is followed by a tag, then any data ends here.
+        if (state != STF_CHUNK_DATA || !input->boundary) {
+            token->state = STF_CHUNK_NONE;
+
+            // An empty tag is still worth a warning if nothing follows it.
+            if (state == STF_CHUNK_DATA && !comment && !taglen)
+                chunk->tag.data = input->data + input->mark + tagoff;
+
+            if (input->counters)
+                input->counters->tokenizing += stf_clock(input->counters) - start;
+            return -1;
+        }
+
+        state  = STF_CHUNK_END;
+        valend = input->pos - input->mark;
+
+        if (valoff == SIZE_MAX)
+            valoff = valend;
+    }
+
+    token->state = STF_CHUNK_NONE;
+
+    // Trim any trailing whitespace.
+    while (valoff != SIZE_MAX && valend > valoff && isspace((unsigned char) input->data[input->mark + valend - 1]))
+        valend--;
+
+    // The buffer might have moved since we started.
+    chunk->tag.data = comment ? "S" : input->data + input->mark + tagoff;
+    chunk->tag.len  = comment ? 1 : taglen;
+
+    if (valoff != SIZE_MAX && valend > valoff) {
+        chunk->value.data = input->data + input->mark + valoff;
+        chunk->value.len  = strnlen(chunk->value.data, valend - valoff);
+    }
+
+    if (input->counters) {
+        input->counters->chunks[chunk->id]++;
+        input->counters->bytes[chunk->id] += chunk->value.len;
+        input->counters->tokenizing += stf_clock(input->counters) - start;
+    }
+
+    //fprintf(stderr, "read a {%.*s} tag with data %.*s\n", STF_SLICE_FMT(chunk->tag), STF_SLICE_FMT(chunk->value));
+    return 0;
+
+  more:
+    token->state    = state;
+    token->tagoff   = tagoff;
+    token->taglen   = taglen;
+    token->valoff   = valoff;
+    token->valend   = valend;
+    token->comment  = comment;
+    token->chunk    = *chunk;
+
+    if (input->counters)
+        input->counters->tokenizing += stf_clock(input->counters) - start;
+    return 1;
+}
+
+void stf_input_compact(struct stf_input *input)
+{
+    size_t discard = input->mark;
+
+    if (input->keeping && input->keep < discard)
+        discard = input->keep;
+
+    if (discard == 0)
+        return;
+
+    memmove(input->data, input->data + discard, input->len - discard);
+
+    input->base += discard;
+    input->len  -= discard;
+    input->pos  -= discard;
+    input->mark -= discard;
+
+    if (input->keeping)
+        input->keep -= discard;
+}
+
+static const char *kMonthNames[] = {
+    "January", "February", "March", "April", "May", "June", "July",
+    "August", "September", "October", "November", "December",
+};
+
+static void select_date_format(struct stf_dates *dates, int dateformat)
+{
+    // Nothing has changed.
+    if (dates->fmt == kStfDateFormats[dateformat])
+        return;
+
+    dates->fmt = kStfDateFormats[dateformat];
+
+    // Previous results are no longer valid.
+    memset(dates->cache, 0, sizeof dates->cache);
+}
+
+// This is how glibc parses numbers, including skipping whitespace and
+// stopping early if another digit would be out of range.
+static bool parse_date_number(const char **s, int from, int to, int digits, int *val)
+{
+    const char *p = *s;
+
+    while (isspace((unsigned char) *p))
+        p++;
+
+    if (*p < '0' || *p > '9')
+        return false;
+
+    *val = 0;
+
+    do {
+        *val = *val * 10 + *p++ - '0';
+    } while (--digits > 0 && *val * 10 <= to && *p >= '0' && *p <= '9');
+
+    *s = p;
+    return *val >= from && *val <= to;
+}
+
+// Equivalent to strptime() in the C locale, including which fields are set
+// if the date doesn't match.
+static bool parse_lotus_date(const char *fmt, const char *s, struct tm *tm)
+{
+    bool have_I = false;
+    bool is_pm = false;
+    size_t len, longest;
+    int val;
+
+    for (; *fmt; fmt++) {
+        if (isspace((unsigned char) *fmt)) {
+            while (isspace((unsigned char) *s))
+                s++;
+            continue;
+        }
+
+        if (*fmt != '%') {
+            if (*fmt != *s++)
+                return false;
+            continue;
+        }
+
+        switch (*++fmt) {
+            case 'm':
+                if (!parse_date_number(&s, 1, 12, 2, &val))
+                    return false;
+                tm->tm_mon = val - 1;
+                break;
+            case 'd':
+                if (!parse_date_number(&s, 1, 31, 2, &val))
+                    return false;
+                tm->tm_mday = val;
+                break;
+            case 'Y':
+                if (!parse_date_number(&s, 0, 9999, 4, &val))
+                    return false;
+                tm->tm_year = val - 1900;
+                break;
+            case 'H':
+                if (!parse_date_number(&s, 0, 23, 2, &val))
+                    return false;
+                tm->tm_hour = val;
+                have_I = false;
+                break;
+            case 'I':
+                if (!parse_date_number(&s, 1, 12, 2, &val))
+                    return false;
+                tm->tm_hour = val % 12;
+                have_I = true;
+                break;
+            case 'M':
+                if (!parse_date_number(&s, 0, 59, 2, &val))
+                    return false;
+                tm->tm_min = val;
+                break;
+            case 'b':
+                // The longest match of the full or abbreviated name wins.
+                for (int i = longest = 0; i < 12; i++) {
+                    if (strncasecmp(kMonthNames[i], s, len = strlen(kMonthNames[i])) == 0
+                     || strncasecmp(kMonthNames[i], s, len = 3) == 0) {
+                        if (len > longest) {
+                            tm->tm_mon = i;
+                            longest = len;
+                        }
+                    }
+                }
+
+                if (!longest)
+                    return false;
+
+                s += longest;
+                break;
+            case 'p':
+                if (strncasecmp(s, "AM", 2) == 0) {
+                    is_pm = false;
+                } else if (strncasecmp(s, "PM", 2) == 0) {
+                    is_pm = true;
+                } else {
+                    return false;
+                }
+                s += 2;
+                break;
+            default:
+                // Not used by any of kStfDateFormats.
+                return false;
+        }
+    }
+
+    if (have_I && is_pm)
+        tm->tm_hour += 12;
+
+    return true;
+}
+
+// Convert a date in the current format to STF_JSON_DATE_FORMAT, returns false
+// if the timestamp couldn't be formatted. The date doesn't have to be nul
+// terminated, it's only copied if it isn't already in the cache.
+static bool convert_lotus_date(struct stf_dates *dates, struct stf_arena *arena, const char *date, size_t len, char *timestamp, size_t size)
+{
+    struct tm parsed = {0};
+    unsigned hash = 2166136261;
+    struct stf_date_cache_entry *entry;
+
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char) date[i]) * 16777619;
+
+    entry = &dates->cache[hash % STF_DATE_CACHE_SIZE];
+
+    if (len < STF_DATE_CACHE_KEY && *entry->timestamp && memcmp(entry->date, date, len) == 0 && entry->date[len] == '\0') {
+        snprintf(timestamp, size, "%s", entry->timestamp);
+        return true;
+    }
+
+    if ((date = stf_arena_strndup(arena, date, len)) == NULL)
+        return false;
+
+    // Note that the result is used even if the date only partially matches.
+    parse_lotus_date(dates->fmt, date, &parsed);
+
+    if (strftime(timestamp, size, STF_JSON_DATE_FORMAT, &parsed) == 0)
+        return false;
+
+    if (len < STF_DATE_CACHE_KEY && strlen(timestamp) < sizeof entry->timestamp) {
+        strcpy(entry->date, date);
+        strcpy(entry->timestamp, timestamp);
+    }
+
+    return true;
+}
+
+uint32_t stf_hash_string(const char *s, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    while (len--) {
+        hash ^= (unsigned char) *s++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static void symbols_reset(struct stf_symbols *symbols)
+{
+    stf_arena_reset(&symbols->arena);
+
+    if (symbols->table)
+        memset(symbols->table, 0, symbols->size * sizeof *symbols->table);
+
+    symbols->count      = 0;
+    symbols->categories = 0;
+}
+
+static void symbols_destroy(struct stf_symbols *symbols)
+{
+    stf_arena_destroy(&symbols->arena);
+    free(symbols->table);
+}
+
+static struct stf_symbol *symbols_find(struct stf_symbols *symbols, const char *key, size_t keylen, uint32_t hash)
+{
+    size_t i = hash & (symbols->size - 1);
+
+    for (; symbols->table[i].key; i = (i + 1) & (symbols->size - 1)) {
+        if (symbols->table[i].hash == hash
+                && symbols->table[i].keylen == keylen
+                && memcmp(symbols->table[i].key, key, keylen) == 0)
+            break;
+    }
+
+    return &symbols->table[i];
+}
+
+// Find the names of a link, splitting them if they haven't been seen before.
+// Returns 1 if there isn't a name, or -1 if memory ran out.
+static int intern_link_names(struct stf_symbols *symbols, const char *names, size_t len, const struct stf_symbol **result)
+{
+    uint32_t hash = stf_hash_string(names, len);
+    const struct stf_symbol *name;
+    struct stf_symbol *symbol;
+    uint32_t id;
+    char *saveptr;
+    char *token;
+    char *key;
+    char *copy;
+    int status;
+
+    // Keep the table at most half full.
+    if (symbols->count >= symbols->size / 2) {
+        struct stf_symbol *old = symbols->table;
+        size_t oldsize = symbols->size;
+
+        symbols->size  = oldsize ? oldsize * 2 : 256;
+        symbols->table = calloc(symbols->size, sizeof *symbols->table);
+
+        // The old table is still usable.
+        if (symbols->table == NULL) {
+            symbols->table = old;
+            symbols->size  = oldsize;
+            return -1;
+        }
+
+        symbols->growth++;
+
+        for (size_t i = 0; i < oldsize; i++) {
+            if (old[i].key) {
+                *symbols_find(symbols, old[i].key, old[i].keylen, old[i].hash) = old[i];
+            }
+        }
+
+        free(old);
+    }
+
+    symbol = symbols_find(symbols, names, len, hash);
+
+    if (symbol->key) {
+        *result = symbol;
+        return 0;
+    }
+
+    if ((key = stf_arena_strndup(&symbols->arena, names, len)) == NULL
+     || (copy = stf_arena_strndup(&symbols->arena, names, len)) == NULL)
+        return -1;
+
+    if ((token = strtok_r(copy, ";", &saveptr)) == NULL)
+        return 1;
+
+    // Links with the same name are the same category, even if the other names
+    // are different, so they share the id of just the name.
+    if (strlen(token) != len) {
+        if ((status = intern_link_names(symbols, token, strlen(token), &name)) != 0)
+            return status;
+
+        id     = name->id;
+        symbol = symbols_find(symbols, names, len, hash);
+    } else {
+        id     = symbols->categories++;
+    }
+
+    symbol->key     = key;
+    symbol->keylen  = len;
+    symbol->hash    = hash;
+    symbol->id      = id;
+    symbol->name    = token;
+
+    if ((token = strtok_r(NULL, ";", &saveptr)) != NULL) {
+        symbol->shortname = token;
+    }
+
+    while ((token = strtok_r(NULL, ";", &saveptr)) != NULL) {
+        const char **alsomatch = stf_arena_alloc(&symbols->arena, (symbol->nalsomatch + 1) * sizeof *alsomatch);
+
+        // It was the end of the chain when it was found, so it can be
+        // removed again.
+        if (alsomatch == NULL) {
+            symbol->key = NULL;
+            return -1;
+        }
+
+        // These lists are short, and it's only done once.
+        if (symbol->nalsomatch)
+            memcpy(alsomatch, symbol->alsomatch, symbol->nalsomatch * sizeof *alsomatch);
+
+        alsomatch[symbol->nalsomatch++] = token;
+        symbol->alsomatch = alsomatch;
+    }
+
+    symbols->count++;
+    *result = symbol;
+    return 0;
+}
+
+static const char *kStateNames[] = {
+    [STF_STATE_NONE]                = "none",
+    [STF_STATE_ROOT]                = "root",
+    [STF_STATE_CATEGORY]            = "category",
+    [STF_STATE_CATEGORY_COND]       = "categoryopts",
+    [STF_STATE_CATEGORY_ACTIONS]    = "categoryopts",
+    [STF_STATE_ITEM]                = "item",
+    [STF_STATE_NOTE]                = "note",
+    [STF_STATE_ATTRIBUTE]           = "attribute",
+    [STF_STATE_ASSIGNMENT]          = "assignment",
+    [STF_STATE_SKIP]                = "skip",
+};
+
+int stf_error(struct stf_context *ctx, const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    vsnprintf(ctx->error, sizeof ctx->error, format, ap);
+    va_end(ap);
+    return -1;
+}
+
+// Any of the callbacks can be NULL.
+#define STF_CALLBACK(ctx, name, ...)                                        \
+    ((ctx)->callbacks && (ctx)->callbacks->name                             \
+        ? (ctx)->callbacks->name((ctx), ##__VA_ARGS__)                      \
+        : 0)
+
+// A callback asked to stop, it might have said why.
+static int stf_stopped(struct stf_context *ctx)
+{
+    if (*ctx->error == '\0')
+        stf_error(ctx, "stopped by callback");
+
+    return -1;
+}
+
+// A decoded copy of the value of a chunk, "" if it didn't have one.
+static int copy_value(struct stf_context *ctx, const struct stf_chunk *chunk, struct stf_slice *value)
+{
+    *value = stf_chunk_value(&ctx->scratch, chunk);
+
+    if (!chunk->escaped)
+        value->data = stf_arena_strndup(&ctx->scratch, value->data ? value->data : "", value->len);
+
+    if (value->data == NULL)
+        return stf_error(ctx, "out of memory copying a value");
+
+    return 0;
+}
+
+// Arrays grow whenever the count reaches a power of two. Returns NULL if
+// that wasn't possible.
+static void *grow_array(struct stf_arena *arena, void *array, size_t count, size_t size)
+{
+    void *grown;
+
+    if (count & (count - 1))
+        return array;
+
+    if ((grown = stf_arena_alloc(arena, (count ? count * 2 : 1) * size)) == NULL)
+        return NULL;
+
+    if (count)
+        memcpy(grown, array, count * size);
+
+    return grown;
+}
+
+static int append_value(struct stf_context *ctx, struct stf_slice **array, size_t *count, struct stf_slice value)
+{
+    struct stf_slice *grown = grow_array(&ctx->scratch, *array, *count, sizeof **array);
+
+    if (grown == NULL)
+        return stf_error(ctx, "out of memory adding a value");
+
+    *array = grown;
+    (*array)[(*count)++] = value;
+    return 0;
+}
+
+static void add_field(int *fields, size_t *nfields, int field)
+{
+    for (size_t i = 0; i < *nfields; i++) {
+        if (fields[i] == field)
+            return;
+    }
+
+    fields[(*nfields)++] = field;
+}
+
+static void add_category_field(struct stf_category *category, int field)
+{
+    add_field(category->fields, &category->nfields, field);
+}
+
+// Where the value of a chunk is, for lazy items.
+static struct stf_span chunk_span(const struct stf_input *input, const struct stf_chunk *chunk)
+{
+    struct stf_span span = {
+        .offset     = input->base + (chunk->value.data ? (size_t) (chunk->value.data - input->data) : input->mark),
+        .len        = chunk->value.len,
+        .escaped    = chunk->escaped,
+    };
+
+    return span;
+}
+
+// Find the type of a link and where the names end. Returns false if it
+// doesn't have a type, otherwise value is set if it has one.
+static bool parse_link_type(const char *def, size_t length, enum stf_link_type *type, size_t *names, const char **value)
+{
+    *value = NULL;
+
+    // Must be at least two characters, one char name and one char type.
+    if (length < 2)
+        return false;
+
+    // First determine what kind of definition this is.
+    // If the last character is \, then this is a standard entry with no data.
+    if (def[length-1] == '\\' && def[length-2] != '%') {
+        *names = length - 1;
+        *type  = STF_LINK_STANDARD;
+
+    // Same as above, but this is an exclusive category.
+    } else if (def[length-1] == '/' && def[length-2] != '%') {
+        *names = length - 1;
+        *type  = STF_LINK_EXCLUSIVE;
+
+    // Unindexed, but need to check if it's numeric or date.
+    } else if (def[length-1] == '|'
+            && def[length-2] != '%'
+            && def[length-2] != '@'
+            && def[length-2] != '#') {
+        *names = length - 1;
+        *type  = STF_LINK_UNINDEXED;
+
+    // I don't need to check for escape characters here, because if it's not a
+    // real value, the pipe would be escaped.
+    } else if ((*value = memmem(def, length, "@|", 2))) {
+        *names = *value - def;
+        *type  = STF_LINK_DATE;
+        *value += 2;
+    } else if ((*value = memmem(def, length, "#|", 2))) {
+        *names = *value - def;
+        *type  = STF_LINK_NUMERIC;
+        *value += 2;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+// Split a link into it's type and names, the value is left until it's needed.
+static int parse_item_link(struct stf_context *ctx, const struct stf_chunk *chunk, struct stf_link *link)
+{
+    struct stf_slice category = stf_chunk_value(&ctx->scratch, chunk);
+    const char *def = category.data;
+    size_t length = category.len;
+    const struct stf_symbol *symbol;
+    const char *value;
+    size_t names;
+    int status;
+
+    memset(link, 0, sizeof *link);
+
+    if (chunk->escaped && def == NULL)
+        return stf_error(ctx, "out of memory decoding a link");
+
+    if (length < 2)
+        return stf_error(ctx, "attempted to parse invalid category link");
+
+    if (!parse_link_type(def, length, &link->type, &names, &value))
+        return stf_error(ctx, "could not determine type of link %.*s", STF_SLICE_FMT(category));
+
+    if ((status = intern_link_names(&ctx->symbols, def, names, &symbol)) < 0)
+        return stf_error(ctx, "out of memory for category names");
+
+    if (status > 0)
+        return stf_error(ctx, "A category must have a name");
+
+    link->id            = symbol->id;
+    link->name          = symbol->name;
+    link->shortname     = symbol->shortname;
+    link->alsomatch     = symbol->alsomatch;
+    link->nalsomatch    = symbol->nalsomatch;
+
+    if (value) {
+        link->value.data = value;
+        link->value.len  = def + length - value;
+    }
+
+    return 0;
+}
+
+// The id is STF_NO_CATEGORY if there isn't a name, returns -1 if memory ran
+// out.
+static int category_id(struct stf_context *ctx, struct stf_slice names, uint32_t *id)
+{
+    const struct stf_symbol *symbol;
+    enum stf_link_type type;
+    const char *value;
+    size_t len;
+    int status;
+
+    *id = STF_NO_CATEGORY;
+
+    if (names.len == 0)
+        return 0;
+
+    // Definitions don't always have a type.
+    if (!parse_link_type(names.data, names.len, &type, &len, &value))
+        len = names.len;
+
+    if ((status = intern_link_names(&ctx->symbols, names.data, len, &symbol)) < 0)
+        return stf_error(ctx, "out of memory for category names");
+
+    if (status == 0)
+        *id = symbol->id;
+
+    return 0;
+}
+
+uint32_t stf_category_id(struct stf_context *ctx, struct stf_slice names)
+{
+    uint32_t id;
+
+    category_id(ctx, names, &id);
+    return id;
+}
+
+int stf_link_timestamp(struct stf_context *ctx, const struct stf_link *link, char *timestamp, size_t size)
+{
+    uint64_t start = stf_clock(&ctx->counters);
+    const char *date, *escape, *separator;
+    char *unescaped, *escaped, *p;
+    size_t len, prefix;
+    bool converted;
+
+    if (link->value.data == NULL)
+        return stf_error(ctx, "link %s doesn't have a value", link->name);
+
+    if (link->type != STF_LINK_DATE)
+        return stf_error(ctx, "didn't expect this type to have a value");
+
+    date = link->value.data;
+    len  = strnlen(date, link->value.len);
+
+    // The date is whatever follows the last ';', not counting the first
+    // character. Until the first escape, nothing moves, so most dates can be
+    // used without copying them.
+    escape = memchr(date, '%', len);
+    prefix = escape ? (size_t) (escape - date) : len;
+
+    if (prefix > 1 && (separator = memrchr(date + 1, ';', prefix - 1))) {
+        len -= separator + 1 - date;
+        date = separator + 1;
+    }
+
+    if (escape) {
+        if ((unescaped = stf_arena_strndup(&ctx->scratch, date, len)) == NULL)
+            return stf_error(ctx, "out of memory decoding a date");
+
+        escaped   = unescaped + (escape - date);
+
+        // Remove the escape chars, the check for ';' sees the input as it was
+        // before it was moved.
+        for (p = escaped; (*p = *escaped++);) {
+            if (*p != '%')
+                p++;
+            if (*p == ';')
+                unescaped = p + 1;
+        }
+
+        date = unescaped;
+        len  = strlen(unescaped);
+    }
+
+    // Parse the date with the current format.
+    converted = convert_lotus_date(&ctx->dates, &ctx->scratch, date, len, timestamp, size);
+
+    ctx->counters.dates += stf_clock(&ctx->counters) - start;
+
+    if (!converted)
+        return stf_error(ctx, "failed to format timestamp for JSON");
+
+    return 0;
+}
+
+void stf_item_chunk(struct stf_context *ctx, const struct stf_span *span, struct stf_chunk *chunk)
+{
+    memset(chunk, 0, sizeof *chunk);
+
+    if (span->len)
+        chunk->value.data = ctx->input.data + (span->offset - ctx->input.base);
+
+    chunk->value.len    = span->len;
+    chunk->escaped      = span->escaped;
+}
+
+int stf_item_link(struct stf_context *ctx, size_t index, struct stf_link *link)
+{
+    uint64_t start = stf_clock(&ctx->counters);
+    struct stf_chunk chunk;
+    int result;
+
+    stf_item_chunk(ctx, &ctx->item.links[index], &chunk);
+
+    result = parse_item_link(ctx, &chunk, link);
+
+    ctx->counters.links += stf_clock(&ctx->counters) - start;
+
+    return result;
+}
+
+// Appendix B-5
+static int parse_stf_header(struct stf_context *ctx, const struct stf_chunk *chunk, char *timestamp, size_t size)
+{
+    char *header = chunk_string(&ctx->scratch, chunk);
+    struct tm date = {0};
+
+    if (header == NULL)
+        return stf_error(ctx, "out of memory reading the STF header");
+
+    if (strptime(header, "%D;%T;002", &date) == NULL)
+        return stf_error(ctx, "failed to parse STF header tag, '%s'", header);
+
+    if (strftime(timestamp, size, STF_JSON_DATE_FORMAT, &date) == 0)
+        return stf_error(ctx, "failed to format timestamp for JSON");
+
+    return 0;
+}
+
+// Pass the input skipped after an error to the caller, then carry on from
+// state.
+static int skip_input(struct stf_context *ctx, size_t end, int state)
+{
+    struct stf_slice data = {
+        .data   = ctx->input.data + (ctx->skipped - ctx->input.base),
+        .len    = end - ctx->skipped,
+    };
+
+    if (STF_CALLBACK(ctx, on_skipped, ctx->skipped, data))
+        return stf_stopped(ctx);
+
+    stf_arena_reset(&ctx->scratch);
+
+    ctx->input.keeping  = false;
+    ctx->state          = state;
+    *ctx->error         = '\0';
+    return 0;
+}
+
+// Decide how much to skip after an error in this chunk. A broken header is
+// skipped to the next block, and an item to it's {!}, because it can contain
+// {.}. Anything else is skipped to the next end, except a bad {d} is just
+// ignored.
+static int skip_from(struct stf_context *ctx, const struct stf_chunk *chunk)
+{
+    size_t offset = ctx->input.base + ctx->input.mark;
+
+    if (!ctx->recover)
+        return -1;
+
+    switch (ctx->state) {
+        case STF_STATE_NONE:
+            ctx->skipped = offset;
+            ctx->skipto  = STF_TAG_STF;
+            break;
+        case STF_STATE_ROOT:
+            ctx->skipped = offset;
+            ctx->skipto  = STF_TAG_UNKNOWN;
+
+            if (chunk->id == STF_TAG_DATEFMT)
+                return skip_input(ctx, ctx->input.base + ctx->input.pos, STF_STATE_ROOT);
+            break;
+        case STF_STATE_ITEM:
+            ctx->skipped = ctx->offset;
+            ctx->skipto  = STF_TAG_END_ITEM;
+            break;
+        default:
+            ctx->skipped = ctx->offset;
+            ctx->skipto  = STF_TAG_UNKNOWN;
+            break;
+    }
+
+    // Items and categories are already being kept.
+    ctx->input.keep     = ctx->skipped - ctx->input.base;
+    ctx->input.keeping  = true;
+    ctx->state          = STF_STATE_SKIP;
+    return 0;
+}
+
+// Returns 1 if the chunk ended the input being skipped, but still has to be
+// parsed.
+static int skip_chunk(struct stf_context *ctx, const struct stf_chunk *chunk)
+{
+    size_t offset = ctx->input.base + ctx->input.mark;
+
+    // Everything ends at a new block, unless it's the one that was broken.
+    if (chunk->id == STF_TAG_STF && offset > ctx->skipped) {
+        if (skip_input(ctx, offset, STF_STATE_NONE) != 0)
+            return -1;
+        return 1;
+    }
+
+    if (chunk->id != STF_TAG_END_ITEM && chunk->id != STF_TAG_END_CATEGORY)
+        return 0;
+
+    if (ctx->skipto == chunk->id || ctx->skipto == STF_TAG_UNKNOWN)
+        return skip_input(ctx, ctx->input.base + ctx->input.pos, STF_STATE_ROOT);
+
+    return 0;
+}
+
+void stf_context_init(struct stf_context *ctx, const struct stf_callbacks *callbacks, void *arg)
+{
+    memset(ctx, 0, sizeof *ctx);
+
+    ctx->callbacks          = callbacks;
+    ctx->arg                = arg;
+    ctx->dateformat         = 1;
+    ctx->state              = STF_STATE_NONE;
+    ctx->input.counters     = &ctx->counters;
+}
+
+void stf_context_destroy(struct stf_context *ctx)
+{
+    stf_arena_destroy(&ctx->scratch);
+    symbols_destroy(&ctx->symbols);
+    free(ctx->buffer);
+}
+
+int stf_parse(struct stf_context *ctx)
+{
+    struct stf_chunk chunk;
+    struct stf_category *category = &ctx->category;
+    int result;
+    int skipped;
+
+    // The error that started a skip is kept until it's reported.
+    if (ctx->state != STF_STATE_SKIP)
+        *ctx->error = '\0';
+
+    select_date_format(&ctx->dates, ctx->dateformat);
+
+    while ((result = stf_read_chunk(&ctx->input, &chunk)) == 0) {
+      skip:
+        if (ctx->state == STF_STATE_SKIP) {
+            if ((skipped = skip_chunk(ctx, &chunk)) < 0)
+                return -1;
+
+            if (skipped)
+                goto reparse;
+            continue;
+        }
+
+        if (chunk.id == STF_TAG_UNKNOWN && chunk.tag.len == 0 && ctx->callbacks && ctx->callbacks->on_warning)
+            ctx->callbacks->on_warning(ctx, "found an empty tag, data maybe malformed");
+
+        // The chunk after an attribute or assignment has to end it, even if
+        // it's a comment.
+        if (ctx->state == STF_STATE_ATTRIBUTE) {
+            if (chunk.id != STF_TAG_END || chunk.value.data != NULL) {
+                stf_error(ctx, "invalid end-attribute tag");
+                goto failed;
+            }
+
+            ctx->state = STF_STATE_CATEGORY;
+            continue;
+        }
+
+        if (ctx->state == STF_STATE_ASSIGNMENT) {
+            struct stf_assignments *assignments = ctx->assignments;
+
+            if (chunk.id == STF_TAG_INCLUDE) {
+                if (append_value(ctx, &assignments->include, &assignments->ninclude, ctx->assignment) != 0)
+                    goto failed;
+            } else if (chunk.id == STF_TAG_EXCLUDE) {
+                if (append_value(ctx, &assignments->exclude, &assignments->nexclude, ctx->assignment) != 0)
+                    goto failed;
+            } else {
+                stf_error(ctx, "failed to find assignment type");
+                goto failed;
+            }
+
+            ctx->state = assignments == &category->actions
+                            ? STF_STATE_CATEGORY_ACTIONS
+                            : STF_STATE_CATEGORY_COND;
+            continue;
+        }
+
+        if (chunk.id == STF_TAG_COMMENT) {
+            if (chunk.value.data && STF_CALLBACK(ctx, on_comment, &chunk)) {
+                stf_stopped(ctx);
+                goto failed;
+            }
+            continue;
+        }
+
+      reparse:
+
+        switch (ctx->state) {
+            case STF_STATE_NONE:
+                switch (chunk.id) {
+                    case STF_TAG_STF: {
+                        char timestamp[128];
+
+                        // Nothing is kept between blocks.
+                        stf_arena_reset(&ctx->scratch);
+                        symbols_reset(&ctx->symbols);
+
+                        if (parse_stf_header(ctx, &chunk, timestamp, sizeof timestamp) != 0)
+                            goto failed;
+
+                        if (STF_CALLBACK(ctx, on_stf_header, timestamp)) {
+                            stf_stopped(ctx);
+                            goto failed;
+                        }
+
+                        ctx->state = STF_STATE_ROOT;
+                        break;
+                    }
+                    default:
+                        goto unexpected;
+                }
+                break;
+            case STF_STATE_ROOT:
+                switch (chunk.id) {
+                    // Change date format, Appendix B-6
+                    case STF_TAG_DATEFMT: {
+                        char *value = chunk_string(&ctx->scratch, &chunk);
+                        int dateformat;
+
+                        if (value == NULL) {
+                            stf_error(ctx, "out of memory reading the date format");
+                            goto failed;
+                        }
+
+                        dateformat = strtoul(value, NULL, 10);
+
+                        // The last valid format is kept if this is skipped.
+                        if (dateformat < 1 || dateformat > 12) {
+                            stf_error(ctx, "invalid date format requested");
+                            goto failed;
+                        }
+
+                        ctx->dateformat = dateformat;
+
+                        select_date_format(&ctx->dates, ctx->dateformat);
+                        break;
+                    }
+
+                    // Start a new category definition.
+                    case STF_TAG_CATEGORY:
+                        ctx->state  = STF_STATE_CATEGORY;
+                        ctx->offset = ctx->input.base + ctx->input.mark;
+
+                        memset(category, 0, sizeof *category);
+
+                        // The whole category is needed if it has to be
+                        // skipped.
+                        if (ctx->recover) {
+                            ctx->input.keep     = ctx->input.mark;
+                            ctx->input.keeping  = true;
+                        }
+
+                        // The category name has symbols declaring it's type, see
+                        // Appendix B-11.
+                        if (copy_value(ctx, &chunk, &category->name) != 0)
+                            goto failed;
+
+                        if (category_id(ctx, category->name, &category->id) != 0)
+                            goto failed;
+                        break;
+
+                    // Start a new item definition
+                    case STF_TAG_ITEM:
+                        ctx->state  = STF_STATE_ITEM;
+                        ctx->offset = ctx->input.base + ctx->input.mark;
+
+                        // The fields are decoded from the input later, so
+                        // the whole item has to stay in the buffer. That's
+                        // also needed if it has to be skipped.
+                        if (ctx->lazy || ctx->recover) {
+                            memset(&ctx->item, 0, sizeof ctx->item);
+                            ctx->input.keep     = ctx->input.mark;
+                            ctx->input.keeping  = true;
+                        }
+
+                        if (STF_CALLBACK(ctx, on_item_begin)) {
+                            stf_stopped(ctx);
+                            goto failed;
+                        }
+                        break;
+
+                    // End of current file, new one begins.
+                    case STF_TAG_STF:
+                        ctx->state = STF_STATE_NONE;
+                        goto reparse;
+
+                    default:
+                        goto unexpected;
+                }
+                break;
+            case STF_STATE_CATEGORY:
+                switch (chunk.id) {
+                    // Undocumented, but Agenda 2.0b will generate these.
+                    case STF_TAG_ATTRIBUTE: {
+                        struct stf_slice attribute;
+
+                        if (copy_value(ctx, &chunk, &attribute) != 0)
+                            goto failed;
+
+                        if (append_value(ctx, &category->attributes, &category->nattributes, attribute) != 0)
+                            goto failed;
+
+                        ctx->state = STF_STATE_ATTRIBUTE;
+                        break;
+                    }
+
+                    // End of category.
+                    case STF_TAG_END_CATEGORY:
+                        category->complete = true;
+
+                        if (STF_CALLBACK(ctx, on_category, category)) {
+                            stf_stopped(ctx);
+                            goto failed;
+                        }
+
+                        stf_arena_reset(&ctx->scratch);
+
+                        ctx->input.keeping = false;
+
+                        ctx->state = STF_STATE_ROOT;
+                        break;
+
+                    // Category note.
+                    case STF_TAG_CATNOTE:
+                        if (copy_value(ctx, &chunk, &category->note) != 0)
+                            goto failed;
+
+                        add_category_field(category, STF_CATEGORY_NOTE);
+                        break;
+
+                    // Undocumented tags, a repeated one replaces the last.
+                    case STF_TAG_CONDITIONS:
+                    case STF_TAG_ACTIONS:
+                        if (chunk.id == STF_TAG_ACTIONS) {
+                            ctx->state       = STF_STATE_CATEGORY_ACTIONS;
+                            ctx->assignments = &category->actions;
+                            add_category_field(category, STF_CATEGORY_ACTIONS);
+                        } else {
+                            ctx->state       = STF_STATE_CATEGORY_COND;
+                            ctx->assignments = &category->conditions;
+                            add_category_field(category, STF_CATEGORY_CONDITIONS);
+                        }
+
+                        memset(ctx->assignments, 0, sizeof *ctx->assignments);
+                        break;
+
+                    default:
+                        goto unexpected;
+                }
+                break;
+            case STF_STATE_CATEGORY_ACTIONS:
+            case STF_STATE_CATEGORY_COND:
+                switch (chunk.id) {
+                    // The next chunk will replace this one, so take a copy.
+                    case STF_TAG_CATEGORY:
+                        if (copy_value(ctx, &chunk, &ctx->assignment) != 0)
+                            goto failed;
+
+                        ctx->state      = STF_STATE_ASSIGNMENT;
+                        break;
+                    case STF_TAG_END:
+                        ctx->state       = STF_STATE_CATEGORY;
+                        ctx->assignments = NULL;
+                        break;
+                    default:
+                        goto unexpected;
+                }
+                break;
+            case STF_STATE_ITEM:
+                switch (chunk.id) {
+                    case STF_TAG_TEXT:
+                        if (ctx->lazy) {
+                            ctx->item.text = chunk_span(&ctx->input, &chunk);
+                            add_field(ctx->item.fields, &ctx->item.nfields, STF_ITEM_TEXT);
+                        } else if (STF_CALLBACK(ctx, on_item_text, &chunk)) {
+                            stf_stopped(ctx);
+                            goto failed;
+                        }
+                        break;
+                    case STF_TAG_NOTE:
+                        if (ctx->lazy) {
+                            ctx->item.note = chunk_span(&ctx->input, &chunk);
+                            add_field(ctx->item.fields, &ctx->item.nfields, STF_ITEM_NOTE);
+                        } else if (STF_CALLBACK(ctx, on_item_note, &chunk)) {
+                            stf_stopped(ctx);
+                            goto failed;
+                        }
+                        break;
+                    // Any associated category
+                    case STF_TAG_CATEGORY: {
+                        uint64_t start;
+                        struct stf_link link;
+                        int result;
+
+                        if (ctx->lazy) {
+                            struct stf_span *links = grow_array(&ctx->scratch, ctx->item.links, ctx->item.nlinks, sizeof *ctx->item.links);
+
+                            if (links == NULL) {
+                                stf_error(ctx, "out of memory adding a link");
+                                goto failed;
+                            }
+
+                            ctx->item.links = links;
+                            ctx->item.links[ctx->item.nlinks++] = chunk_span(&ctx->input, &chunk);
+                            break;
+                        }
+
+                        start = stf_clock(&ctx->counters);
+
+                        if (parse_item_link(ctx, &chunk, &link) != 0)
+                            goto failed;
+
+                        result = STF_CALLBACK(ctx, on_item_link, &link);
+
+                        ctx->counters.links += stf_clock(&ctx->counters) - start;
+
+                        if (result) {
+                            stf_stopped(ctx);
+                            goto failed;
+                        }
+                        break;
+                    }
+                    case STF_TAG_END_CATEGORY:
+                        break;
+                    case STF_TAG_END_ITEM:
+                        if (STF_CALLBACK(ctx, on_item_end, true)) {
+                            stf_stopped(ctx);
+                            goto failed;
+                        }
+
+                        stf_arena_reset(&ctx->scratch);
+
+                        ctx->input.keeping = false;
+
+                        ctx->state = STF_STATE_ROOT;
+                        break;
+                    default:
+                        goto unexpected;
+                }
+                break;
+            default:
+                return stf_error(ctx, "unexpected state transition, %.*s", STF_SLICE_FMT(chunk.tag));
+        }
+        continue;
+
+      unexpected:
+        stf_error(ctx, "[%s] unexpected tag %.*s here", kStateNames[ctx->state], STF_SLICE_FMT(chunk.tag));
+
+      failed:
+        if (skip_from(ctx, &chunk) != 0)
+            return -1;
+
+        // This chunk might be the end of what's skipped.
+        if (ctx->state == STF_STATE_SKIP)
+            goto skip;
+    }
+
+    // Wait for more to be fed.
+    if (result > 0)
+        return 0;
+
+    // The input ran out after an empty tag, see stf_read_chunk().
+    if (chunk.tag.data && chunk.tag.len == 0 && ctx->state != STF_STATE_SKIP && ctx->callbacks && ctx->callbacks->on_warning)
+        ctx->callbacks->on_warning(ctx, "found an empty tag, data maybe malformed");
+
+    // Whatever follows this input ends anything being skipped.
+    if (ctx->state == STF_STATE_SKIP)
+        goto skipped;
+
+    if (ctx->state == STF_STATE_ATTRIBUTE) {
+        stf_error(ctx, "failed to find end-attribute tag");
+        goto truncated;
+    }
+
+    if (ctx->state == STF_STATE_ASSIGNMENT) {
+        stf_error(ctx, "failed to find end-category tag");
+        goto truncated;
+    }
+
+    // If there's another block or item after this input, it would have been
+    // an error to see it here.
+    if (ctx->input.boundary && ctx->state != STF_STATE_ROOT && ctx->state != STF_STATE_NONE) {
+        stf_error(ctx, "[%s] unexpected tag %s here", kStateNames[ctx->state], ctx->continues ? "I" : "STF");
+        goto truncated;
+    }
+
+    // Let the caller decide what to do with anything still open at EOF.
+    switch (ctx->state) {
+        case STF_STATE_ITEM:
+            if (STF_CALLBACK(ctx, on_item_end, false)) {
+                stf_stopped(ctx);
+                goto truncated;
+            }
+
+            ctx->input.keeping = false;
+            break;
+        case STF_STATE_CATEGORY:
+        case STF_STATE_CATEGORY_COND:
+        case STF_STATE_CATEGORY_ACTIONS:
+            category->complete = false;
+
+            if (STF_CALLBACK(ctx, on_category, category)) {
+                stf_stopped(ctx);
+                goto truncated;
+            }
+
+            ctx->input.keeping = false;
+            break;
+    }
+
+    return 0;
+
+  truncated:
+    if (!ctx->recover)
+        return -1;
+
+    ctx->skipped = ctx->offset;
+
+  skipped:
+    return skip_input(ctx, ctx->input.base + ctx->input.len, ctx->continues ? STF_STATE_ROOT : STF_STATE_NONE);
+}
+
+int stf_parse_buffer(struct stf_context *ctx, const char *data, size_t len)
+{
+    scan_tag_t scan_tag = ctx->input.scan_tag;
+
+    memset(&ctx->input, 0, sizeof ctx->input);
+
+    // The tokenizer never writes to the input.
+    ctx->input.data     = (char *) data;
+    ctx->input.len      = len;
+    ctx->input.eof      = true;
+    ctx->input.counters = &ctx->counters;
+    ctx->input.scan_tag = scan_tag;
+
+    return stf_parse(ctx);
+}
+
+int stf_feed(struct stf_context *ctx, const char *data, size_t len)
+{
+    struct stf_input *input = &ctx->input;
+    char *buffer;
+
+    // Discard everything that's been parsed.
+    if (input->data)
+        stf_input_compact(input);
+
+    if (ctx->size - input->len < len) {
+        size_t size = ctx->size ? ctx->size : 4096;
+
+        while (size - input->len < len)
+            size *= 2;
+
+        if ((buffer = realloc(ctx->buffer, size)) == NULL)
+            return stf_error(ctx, "failed to allocate input buffer");
+
+        ctx->buffer = buffer;
+        ctx->size   = size;
+    }
+
+    if (len)
+        memcpy(ctx->buffer + input->len, data, len);
+
+    input->data  = ctx->buffer;
+    input->len  += len;
+
+    return stf_parse(ctx);
+}
+
+int stf_finish(struct stf_context *ctx)
+{
+    ctx->input.eof = true;
+
+    return stf_parse(ctx);
+}
@@ -0,0 +1,402 @@
+#ifndef STF_H
+#define STF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+//
+// libstf, a parser for the STF format that Lotus Agenda exports.
+//
+// The input is tokenized into chunks, a tag and it's value, and a state
+// machine turns those into callbacks for each {STF} header, category, item
+// and item link. Errors are returned rather than exiting, and the message is
+// in the context.
+//
+
+// How you want dates to appear in JSON output.
+#define STF_JSON_DATE_FORMAT "%Y-%m-%dT%H:%M:%SZ"
+
+#define STF_OPEN_TAG '{'
+#define STF_CLOSE_TAG '}'
+#define STF_ESCAPE_TAG ' '
+
+// The table from Appendix B-7, translated into strptime formats.
+extern const char *kStfDateFormats[];
+
+// The tags from Appendix B-4, interned by stf_read_chunk() so they can be
+// handled with a switch.
+enum stf_tag {
+    STF_TAG_UNKNOWN,
+    STF_TAG_STF,            // {STF}
+    STF_TAG_DATEFMT,        // {d}
+    STF_TAG_CATEGORY,       // {C}
+    STF_TAG_DONE,           // {D}
+    STF_TAG_CATNOTE,        // {F}
+    STF_TAG_ENTRY,          // {E}
+    STF_TAG_CATNOTEFILE,    // {G}
+    STF_TAG_ITEM,           // {I}
+    STF_TAG_NOTE,           // {N}
+    STF_TAG_NOTEFILE,       // {O}
+    STF_TAG_COMMENT,        // {S}
+    STF_TAG_TEXT,           // {T}
+    STF_TAG_WHEN,           // {W}
+    STF_TAG_ATTRIBUTE,      // {r}
+    STF_TAG_CONDITIONS,     // {p}
+    STF_TAG_ACTIONS,        // {a}
+    STF_TAG_END,            // {;}
+    STF_TAG_INCLUDE,        // {+}
+    STF_TAG_EXCLUDE,        // {-}
+    STF_TAG_END_CATEGORY,   // {.}
+    STF_TAG_END_ITEM,       // {!}
+    STF_TAG_COUNT,
+};
+
+extern const char *kStfTagNames[STF_TAG_COUNT];
+
+// A simple bump allocator for short lived strings, everything allocated from
+// an arena is released at once by stf_arena_reset(), and the memory reused.
+struct stf_arena_block {
+    struct stf_arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct stf_arena {
+    struct stf_arena_block *head;   // Blocks in use, the first is the current.
+    struct stf_arena_block *free;   // Blocks available for reuse.
+    uint64_t blocks;                // Number of blocks ever allocated.
+};
+
+// These return NULL if a new block was needed and couldn't be allocated.
+void *stf_arena_alloc(struct stf_arena *arena, size_t size);
+char *stf_arena_strndup(struct stf_arena *arena, const char *s, size_t len);
+void stf_arena_reset(struct stf_arena *arena);
+void stf_arena_destroy(struct stf_arena *arena);
+
+// A view of some bytes in the input buffer, not nul terminated.
+struct stf_slice {
+    const char *data;
+    size_t len;
+};
+
+// Use with "%.*s" to print a slice.
+#define STF_SLICE_FMT(s) (int)(s).len, (s).data
+
+// A tag and it's associated value. These point directly into the input
+// buffer, and are only valid until the next call to stf_read_chunk().
+struct stf_chunk {
+    enum stf_tag id;
+    struct stf_slice tag;
+    struct stf_slice value;     // data is NULL if there was no value.
+    bool escaped;               // The value contains escaped tags.
+};
+
+// Decode any escaped tags in the value of a chunk, the result is only copied
+// to the arena if that was necessary. The data is NULL if that copy couldn't
+// be allocated.
+struct stf_slice stf_chunk_value(struct stf_arena *arena, const struct stf_chunk *chunk);
+
+// Counters for each context, so callers can see where the time goes.
+struct stf_counters {
+    bool timing;                        // Measuring time isn't free.
+    uint64_t chunks[STF_TAG_COUNT];     // Read of each tag.
+    uint64_t bytes[STF_TAG_COUNT];      // In the values of those chunks.
+    uint64_t tokenizing;                // Nanoseconds in each stage.
+    uint64_t links;
+    uint64_t dates;
+};
+
+// Where the tokenizer is in the chunk it's reading.
+enum {
+    STF_CHUNK_NONE,     // Between chunks.
+    STF_CHUNK_TAG,
+    STF_CHUNK_DATA,
+    STF_CHUNK_COMMENT,
+    STF_CHUNK_NOTE,
+    STF_CHUNK_END,
+};
+
+// The tokenizer can stop part way through a chunk when the input runs out,
+// and carry on from here when there's more. The offsets are relative to the
+// mark, so they're still valid if the buffer moves.
+struct stf_token {
+    int state;
+    size_t tagoff;
+    size_t taglen;
+    size_t valoff;
+    size_t valend;
+    bool comment;
+    struct stf_chunk chunk;
+};
+
+// The tokenizer scans a buffer of input directly. When it needs more, it
+// calls fill(), which must keep everything from mark onwards (or from keep,
+// while keeping), although it can move it, and either add more data or set
+// eof. Without fill(), the tokenizer stops until more is added.
+struct stf_input {
+    char *data;
+    size_t mark;    // Offset of the chunk being read, kept when refilling.
+    size_t keep;    // Offset of earlier data the parser still needs.
+    bool keeping;
+    size_t pos;     // Offset of the next unread byte.
+    size_t len;     // Number of valid bytes in data.
+    size_t base;    // Offset of data in the whole input.
+    bool eof;
+    bool boundary;  // The input is part of a file that continues with a tag.
+    void (*fill)(struct stf_input *input, void *arg);
+    void *fillarg;
+    struct stf_counters *counters;
+    struct stf_token token;
+
+    // The tag scanner, NULL for the best one, see stf_use_scan_tag().
+    const char *(*scan_tag)(const char *p, const char *end, bool *escaped);
+};
+
+// The names of the tag scanners in this build from the simplest to the
+// fastest, NULL terminated. Any of them can be used for an input instead of
+// the best one the cpu supports, so they can be compared. Returns false if
+// the cpu doesn't support it.
+extern const char *kStfScanTagNames[];
+
+bool stf_use_scan_tag(struct stf_input *input, const char *name);
+
+// Returns 0 for a chunk, -1 when there are no more chunks, or 1 if the input
+// ran out part way through one before eof. Tags and values end at a NUL. If
+// the last chunk had an empty tag but no end, -1 still sets its tag.
+int stf_read_chunk(struct stf_input *input, struct stf_chunk *chunk);
+
+// Move whatever has to be kept to the start of the buffer, so fill() can
+// reuse the space before it.
+void stf_input_compact(struct stf_input *input);
+
+uint32_t stf_hash_string(const char *s, size_t len);
+
+// Dates are parsed by a specialized version of strptime() that only handles
+// the conversions used in kStfDateFormats, and the results are memoized because
+// many items share the same dates.
+#define STF_DATE_CACHE_SIZE 256
+#define STF_DATE_CACHE_KEY  32
+
+struct stf_date_cache_entry {
+    char date[STF_DATE_CACHE_KEY];
+    char timestamp[64];
+};
+
+struct stf_dates {
+    const char *fmt;    // The current entry from kStfDateFormats.
+    struct stf_date_cache_entry cache[STF_DATE_CACHE_SIZE];
+};
+
+// Item links repeat the same few category names many times, so the names are
+// only split once per block and kept in this table.
+struct stf_symbol {
+    const char *key;            // The names exactly as they appear in links.
+    size_t keylen;
+    uint32_t hash;
+    uint32_t id;
+    const char *name;
+    const char *shortname;
+    const char **alsomatch;
+    size_t nalsomatch;
+};
+
+struct stf_symbols {
+    struct stf_arena arena;     // Everything here lasts until the next block.
+    struct stf_symbol *table;
+    size_t size;                // Always a power of two.
+    size_t count;
+    uint32_t categories;        // Number of category ids used.
+    uint64_t growth;            // Number of times the table grew.
+};
+
+// Categories are numbered from zero in each {STF} block, in the order the
+// parser first sees their name, whether that's in a definition or a link.
+#define STF_NO_CATEGORY UINT32_MAX
+
+// Category Type Symbols (Appendix B-11)
+enum stf_link_type {
+    STF_LINK_STANDARD,          //  \       Standard category
+    STF_LINK_EXCLUSIVE,         //  /       Exclusive
+    STF_LINK_DATE,              //  @|      Date
+    STF_LINK_UNINDEXED,         //  |       Unindexed
+    STF_LINK_NUMERIC,           //  #|      Numeric
+};
+
+extern const char *kStfLinkTypeNames[];
+
+// A link from an item to a category. The names are valid until the next
+// {STF} block, the value only during the callback.
+struct stf_link {
+    enum stf_link_type type;
+    uint32_t id;                // Of the category with this name.
+    const char *name;
+    const char *shortname;      // NULL if there isn't one.
+    const char **alsomatch;
+    size_t nalsomatch;
+    struct stf_slice value;     // Still escaped, data is NULL unless the
+                                // link ended with @| or #|.
+};
+
+// The undocumented {p} and {a} sections of a category.
+struct stf_assignments {
+    struct stf_slice *include;
+    size_t ninclude;
+    struct stf_slice *exclude;
+    size_t nexclude;
+};
+
+enum {
+    STF_CATEGORY_NOTE,
+    STF_CATEGORY_CONDITIONS,
+    STF_CATEGORY_ACTIONS,
+    STF_CATEGORY_FIELDS,
+};
+
+// A complete category definition, everything is decoded and valid only
+// during the callback. If a field appears more than once, the last one wins
+// but it keeps it's original position.
+struct stf_category {
+    uint32_t id;                        // STF_NO_CATEGORY if there's no name.
+    struct stf_slice name;
+    struct stf_slice *attributes;
+    size_t nattributes;
+    struct stf_slice note;
+    struct stf_assignments conditions;
+    struct stf_assignments actions;
+    int fields[STF_CATEGORY_FIELDS];    // The order the optional fields
+    size_t nfields;                     // first appeared in.
+    bool complete;                      // False if the input ended first.
+};
+
+// Where a field of an item is in the input, the offset is from the start of
+// the whole input so it doesn't change when the buffer moves.
+struct stf_span {
+    size_t offset;
+    size_t len;                 // Zero if there was no value.
+    bool escaped;
+};
+
+enum {
+    STF_ITEM_TEXT,
+    STF_ITEM_NOTE,
+    STF_ITEM_FIELDS,
+};
+
+// In lazy mode, items are only indexed as they're read, and the fields are
+// decoded on demand with stf_item_chunk() and stf_item_link(). Like a
+// category, the last text or note wins but keeps it's original position.
+struct stf_item {
+    struct stf_span text;
+    struct stf_span note;
+    int fields[STF_ITEM_FIELDS];
+    size_t nfields;
+    struct stf_span *links;
+    size_t nlinks;
+};
+
+struct stf_context;
+
+// Return zero to continue, or non-zero to stop parsing with an error, which
+// can be described with stf_error(). Any callback can be NULL. In lazy mode,
+// the item fields are decoded by on_item_end() instead of being passed to
+// on_item_text(), on_item_note() and on_item_link().
+//
+// If recover is set in the context, an error doesn't stop parsing. Whatever
+// was being parsed is skipped until it's {!} or {.}, or the next {STF} block,
+// then on_skipped() is called with the data and the offset it started at.
+// The error is still in ctx->error, and the data is only valid during the
+// callback.
+struct stf_callbacks {
+    int (*on_stf_header)(struct stf_context *ctx, const char *timestamp);
+    int (*on_category)(struct stf_context *ctx, const struct stf_category *category);
+    int (*on_item_begin)(struct stf_context *ctx);
+    int (*on_item_text)(struct stf_context *ctx, const struct stf_chunk *chunk);
+    int (*on_item_note)(struct stf_context *ctx, const struct stf_chunk *chunk);
+    int (*on_item_link)(struct stf_context *ctx, const struct stf_link *link);
+    int (*on_item_end)(struct stf_context *ctx, bool complete);
+    int (*on_comment)(struct stf_context *ctx, const struct stf_chunk *chunk);
+    void (*on_warning)(struct stf_context *ctx, const char *message);
+    int (*on_skipped)(struct stf_context *ctx, size_t offset, struct stf_slice data);
+};
+
+enum {
+    STF_STATE_NONE,
+    STF_STATE_ROOT,
+    STF_STATE_CATEGORY,
+    STF_STATE_CATEGORY_COND,
+    STF_STATE_CATEGORY_ACTIONS,
+    STF_STATE_ITEM,
+    STF_STATE_NOTE,
+    STF_STATE_ATTRIBUTE,        // Expecting {;} after {r}.
+    STF_STATE_ASSIGNMENT,       // Expecting {+} or {-} after {C}.
+    STF_STATE_SKIP,             // Looking for the end after an error.
+};
+
+struct stf_context {
+    struct stf_input input;
+    const struct stf_callbacks *callbacks;
+    void *arg;                  // For the callbacks.
+    struct stf_arena scratch;   // Released after each category or item.
+    struct stf_symbols symbols;
+    struct stf_dates dates;
+    int dateformat;             // The default is 1, Appendix B-6
+    int state;                  // Kept between calls to stf_parse().
+    bool continues;             // Whether the input is followed by an item,
+                                // otherwise a block.
+    size_t offset;              // Of the category or item being parsed.
+    bool lazy;                  // Index items rather than decode them.
+    bool recover;               // Skip anything that can't be parsed.
+    size_t skipped;             // Where the input being skipped started,
+    enum stf_tag skipto;        // and the end tag, unknown for either.
+    struct stf_category category;
+    struct stf_item item;
+    struct stf_assignments *assignments;
+    struct stf_slice assignment;    // The category name waiting for {+} or {-}.
+    char *buffer;               // Everything fed that hasn't been parsed.
+    size_t size;
+    struct stf_counters counters;
+    char error[1024];
+};
+
+void stf_context_init(struct stf_context *ctx, const struct stf_callbacks *callbacks, void *arg);
+void stf_context_destroy(struct stf_context *ctx);
+
+// Parse everything in ctx->input, carrying on from the state left by the
+// last call. Returns zero on success, or -1 with a message in ctx->error.
+int stf_parse(struct stf_context *ctx);
+
+// Parse a complete STF file from a buffer.
+int stf_parse_buffer(struct stf_context *ctx, const char *data, size_t len);
+
+// Parse data as it arrives, it can be split anywhere. Only the incomplete
+// chunk at the end is kept until the next call. Call stf_finish() after the
+// last of it, to handle anything left over. These return the same as
+// stf_parse().
+int stf_feed(struct stf_context *ctx, const char *data, size_t len);
+int stf_finish(struct stf_context *ctx);
+
+// The id of a category from the names in a link or definition, like the
+// {p} and {a} sections of a category. Returns STF_NO_CATEGORY if there isn't
+// a name, or if there was no memory for it, in which case the error is set.
+uint32_t stf_category_id(struct stf_context *ctx, struct stf_slice names);
+
+// Convert the value of a date link to STF_JSON_DATE_FORMAT, using the date
+// format in effect. Returns -1 if the link doesn't have a date.
+int stf_link_timestamp(struct stf_context *ctx, const struct stf_link *link, char *timestamp, size_t size);
+
+// In lazy mode, the chunk for the text or note of the current item as it
+// would have been passed to on_item_text() or on_item_note(), only the value
+// is set.
+void stf_item_chunk(struct stf_context *ctx, const struct stf_span *span, struct stf_chunk *chunk);
+
+// In lazy mode, parse one of the links of the current item, as it would have
+// been passed to on_item_link(). It's valid until the item ends. Returns
+// zero on success, or -1 with a message in ctx->error.
+int stf_item_link(struct stf_context *ctx, size_t index, struct stf_link *link);
+
+// Set the error message, always returns -1.
+int stf_error(struct stf_context *ctx, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
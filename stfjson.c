@@ -4,12 +4,25 @@
 #include <string.h>
 #include <strings.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <time.h>
 #include <ctype.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <regex.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #include <json.h>
 
+#include "stf.h"
+
 //
 // Quick code to convert Lotus Agenda STF format to JSON.
 //
@@ -17,566 +30,3492 @@
 // Date: October, 2020
 //
 
-// How you want dates to appear in JSON output.
-#define JSON_DATE_FORMAT "%Y-%m-%dT%H:%M:%SZ"
-
-#define STF_OPEN_TAG '{'
-#define STF_CLOSE_TAG '}'
-#define STF_ESCAPE_TAG ' '
-
-// The table from Appendix B-7, translated into strptime formats.
-// NOTE: The manual incorrectly claims 2-digit years are used.
-const char * kLotusDateFmt[] = {
-    NULL,                // 0
-    "%m/%d/%Y %H:%M",    // 1
-    "%m/%d/%Y %H:%M",    // 2
-    "%d.%m.%Y %H:%M",    // 3
-    "%Y-%m-%d %H:%M",    // 4
-    "%d-%b %H:%M",       // 5
-    "%d-%b-%Y %H:%M",    // 6
-    "%m/%d/%Y %I:%M%p",  // 7
-    "%d/%m/%Y %I:%M%p",  // 8
-    "%d.%m.%Y %I:%M%p",  // 9
-    "%Y-%m-%d %I:%M%p",  // 10
-    "%d-%b %I:%M%p",     // 11
-    "%d-%b-%Y %I:%M%p",  // 12
-};
-
-// These are the tags from Appendix B-4
-// Documented
-// {d}      Specified a date format, such as MM/DD/YY
-// {C}      Beginning of a category specification (the category and family with
-//          any associated notes)
-// {D}      Done date
-// {F}      Beginning of a category note
-// {E}      Entry date
-// {G}      Name of the note file for the category
-// {I}      Beginning of an item specification (the item and associated
-//          categories, and notes)
-// {N}      Beginning of an item note
-// {O}      Name of the note file for an item
-// {S}      Beginning of comment text to be ignored when imported
-// {STF}    Header that begins a structured file
-// {T}      Beginning of the text of an item
-// {W}      When date
-// {.}      End of a category specification
-// {!}      End of an item specification
-
-// Undocumented
-// { ...    Escaped STF tag, remove the space then emit verbatim.
-// {r}      Category attribute?
-//          AC      - Apply Conditions?
-//          PEA     - Protected?
-// {;}      End of attribute/link.
-// {p}      Category Assignment Conditions
-// {a}      Category Assignment Action
-// {+}      Category Include
-// {-}      Category Exclude
-
-// Category Type Symbols (Appendix B-11)
-//  \       Standard category
-//  /       Exclusive
-//  |       Unindexed (Note: manual says ¦, but all samples use |)
-//  #|      Numeric
-//  @|      Date
-//
-// Note that as described in Appendix B-13, Agenda uses % as an escape
-// character for literal symbols.
-
-int read_stf_chunk(char **tag, char **value)
-{
-    size_t tagsz, valsz;
-    size_t tagmax, valmax;
-    int c;
-    enum {
-        STF_CHUNK_TAG,
-        STF_CHUNK_DATA,
-        STF_CHUNK_COMMENT,
-        STF_CHUNK_NOTE,
-        STF_CHUNK_END,
-    } state;
-
-    // Everything before the tag is a comment.
-    state = STF_CHUNK_COMMENT;
-
-    // Initialize everything to zero.
-    tagsz   = 0;
-    valsz   = 0;
-    *tag    = 0;
-    *value  = 0;
-    tagmax  = 0;
-    valmax  = 0;
-
-    while (state != STF_CHUNK_END) {
-        // Read next character of input.
-        if ((c = getc(stdin)) == EOF)
-            break;
+// Counters for -S, to see where the time goes. Each thread keeps it's own,
+// and they're added up when it finishes.
+struct stf_stats {
+    uint64_t chunks[STF_TAG_COUNT];     // Read of each tag.
+    uint64_t bytes[STF_TAG_COUNT];      // In the values of those chunks.
+    uint64_t tokenizing;                // Nanoseconds spent in each stage.
+    uint64_t links;
+    uint64_t dates;
+    uint64_t formatting;
+    uint64_t inputgrowth;               // Times each kind of buffer grew.
+    uint64_t buffergrowth;
+    uint64_t arenablocks;
+    uint64_t symbolgrowth;
+    uint64_t inputbytes;                // In every file converted.
+};
 
-        switch (state) {
-            // If anything appears before a tag, then it is a comment.
-            case STF_CHUNK_COMMENT:
+static bool collect_stats;
+static __thread struct stf_stats stats;
+static struct stf_stats totals;
 
-                // Just ignore any leading whitespace.
-                if (isspace(c))
-                    continue;
+static uint64_t stats_clock(void)
+{
+    struct timespec ts;
 
-                // OK, a tag is being opened, start reading it.
-                if (c == STF_OPEN_TAG) {
-                    state = STF_CHUNK_TAG;
-                    break;
-                }
+    if (!collect_stats)
+        return 0;
 
-                // OK, this comment has actual content, fake a comment tag.
-                state = STF_CHUNK_DATA;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
-                tagsz   = 1;
-                tagmax  = 1;
-                *tag    = strdup("S");
+// Add the counters from this thread to the totals, the caller must make
+// sure no other thread is doing the same.
+static void stats_merge(void)
+{
+    uint64_t *from = (uint64_t *) &stats;
+    uint64_t *to = (uint64_t *) &totals;
 
-                // fallthrough
-            case STF_CHUNK_DATA:
+    for (size_t i = 0; i < sizeof stats / sizeof *from; i++)
+        to[i] += from[i];
 
-                // Check if this is the start of a new tag, therefore the end
-                // of our data.
-                if (c == STF_OPEN_TAG) {
-                    int tagc = getc(stdin);
+    memset(&stats, 0, sizeof stats);
+}
 
-                    // If the first character was an escape, this is not a tag.
-                    if (tagc != STF_ESCAPE_TAG) {
-                        ungetc(tagc, stdin);
-                        ungetc(c, stdin);
+// Input is either a memory mapped file, or read in large blocks into a buffer
+// that the tokenizer scans directly.
+#define INPUT_BLOCK_SIZE (1 << 20)
+
+struct stf_file {
+    const char *name;
+    int fd;
+    int inotify;    // Used to wait for a followed file to change.
+    size_t size;    // Allocated size of the buffer, if not mapped.
+    bool mapped;
+    bool follow;    // Wait for more data at EOF, like tail -f.
+    void (*idle)(void *arg);    // Called before waiting.
+    void *idlearg;
+};
 
-                        // finished
-                        state = STF_CHUNK_END;
+static void input_refill(struct stf_input *input, void *arg);
 
-                        // Trim any trailing whitespace.
-                        while (valsz && isspace((*value)[valsz - 1]))
-                            (*value)[--valsz] = '\0';
-                        break;
-                    }
-                }
+static void input_open(struct stf_input *input, struct stf_file *file, const char *filename, bool follow)
+{
+    struct stat st;
 
-                // Discard leading whitespace.
-                if (isspace(c) && !valsz)
-                    break;
+    memset(file, 0, sizeof *file);
 
-                // Grow buffer if necessary.
-                if (valsz >= valmax) {
-                    *value = realloc(*value, valmax += 1024);
+    file->name      = filename ? filename : "stdin";
+    file->fd        = STDIN_FILENO;
+    file->inotify   = -1;
+    file->follow    = follow;
+    input->fill     = input_refill;
+    input->fillarg  = file;
 
-                    // Initialize to zero.
-                    memset(*value + valsz, 0, valmax - valsz);
-                }
+    if (filename && (file->fd = open(filename, O_RDONLY)) == -1) {
+        err(EXIT_FAILURE, "failed to open %s", filename);
+    }
 
-                (*value)[valsz++] = c;
-                break;
-            case STF_CHUNK_TAG:
-                // Check if we've finished reading the tagname.
-                if (c == STF_CLOSE_TAG) {
-                    state = STF_CHUNK_DATA;
-
-                    if (!tagsz) {
-                        warnx("found an empty tag, data maybe malformed");
-                        break;
-                    }
-
-                    // There are some tags that don't have data, just end.
-                    if (strcmp(*tag, ";") == 0    // UNDOCUMENTED; End of attribute.
-                     || strcmp(*tag, "+") == 0    // UNDOCUMENTED; Category relationship.
-                     || strcmp(*tag, "-") == 0    // UNDOCUMENTED; Category relationship.
-                     || strcmp(*tag, ".") == 0    // End of a category specification.
-                     || strcmp(*tag, "!") == 0) { // End of an item specification.
-                        state = STF_CHUNK_END;
-                    }
-                    break;
-                }
-                if (tagsz >= tagmax) {
-                    *tag = realloc(*tag, tagmax += 32);
+    // A followed file is going to grow, so has to be read as it changes.
+    if (follow) {
+        if ((file->inotify = inotify_init1(IN_CLOEXEC)) != -1
+                && inotify_add_watch(file->inotify, filename, IN_MODIFY | IN_ATTRIB) == -1) {
+            close(file->inotify);
+            file->inotify = -1;
+        }
+    }
 
-                    // Initialize to zero.
-                    memset(*tag + tagsz, 0, tagmax - tagsz);
-                }
+    // If this is a regular file, just map the whole thing.
+    if (!follow && fstat(file->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        input->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
 
-                (*tag)[tagsz++] = c;
-                break;
+        if (input->data != MAP_FAILED) {
+            madvise(input->data, st.st_size, MADV_SEQUENTIAL);
+            input->len    = st.st_size;
+            input->eof    = true;
+            file->mapped  = true;
+            return;
         }
     }
 
-    if (state != STF_CHUNK_END)
-        return -1;
+    // Otherwise, it's probably a pipe.
+    file->size  = INPUT_BLOCK_SIZE;
 
-    //fprintf(stderr, "read a {%s} tag with data %s\n", *tag, *value);
-    return 0;
+    if ((input->data = malloc(file->size)) == NULL)
+        err(EXIT_FAILURE, "failed to allocate input buffer");
+}
+
+// Wait for a followed file to grow.
+static void input_wait(struct stf_input *input, struct stf_file *file)
+{
+    char events[4096];
+    struct stat st;
+
+    if (file->idle)
+        file->idle(file->idlearg);
+
+    // If inotify isn't available, just poll.
+    if (file->inotify == -1) {
+        sleep(1);
+    } else if (read(file->inotify, events, sizeof events) == -1 && errno != EINTR) {
+        err(EXIT_FAILURE, "failed to wait for input");
+    }
+
+    if (fstat(file->fd, &st) == 0 && (size_t) st.st_size < input->base + input->len) {
+        errx(EXIT_FAILURE, "input was truncated while following it");
+    }
 }
 
-void parse_item_category(struct json_object *links, int dateformat, const char *def)
+// Read the next block of input into the buffer, growing it if it's full.
+static void input_read(struct stf_input *input, struct stf_file *file)
 {
-    char *token;
-    char *names;
-    char *value;
-    char *root;
-    size_t length;
-    struct json_object *link;
-    enum {
-        STF_CAT_STANDARD,
-        STF_CAT_EXCLUSIVE,
-        STF_CAT_DATE,
-        STF_CAT_UNINDEXED,
-        STF_CAT_NUMERIC,
-    } type;
+    ssize_t result;
+
+    if (input->len == file->size) {
+        file->size *= 2;
 
-    length = strlen(def);
-    names  = NULL;
-    value  = NULL;
-    root   = NULL;
+        if ((input->data = realloc(input->data, file->size)) == NULL)
+            err(EXIT_FAILURE, "failed to grow input buffer");
 
-    // Must be at least two characters, one char name and one char type.
-    if (length < 2) {
-        errx(EXIT_FAILURE, "attempted to parse invalid category link");
+        stats.inputgrowth++;
     }
 
-    link = json_object_new_object();
+    do {
+        result = read(file->fd, input->data + input->len, file->size - input->len);
+    } while (result == -1 && errno == EINTR);
 
-    // First determine what kind of definition this is.
-    // If the last character is \, then this is a standard entry with no data.
-    if (def[length-1] == '\\' && def[length-2] != '%') {
-        names = strndup(def, length - 1);
-        type  = STF_CAT_STANDARD;
-        json_object_object_add(link, "type", json_object_new_string("standard"));
-        goto parsenames;
+    if (result == -1)
+        err(EXIT_FAILURE, "failed to read input");
+
+    if (result == 0 && file->follow) {
+        input_wait(input, file);
+        return;
     }
 
-    // Same as above, but this is an exclusive category.
-    if (def[length-1] == '/' && def[length-2] != '%') {
-        names = strndup(def, length - 1);
-        type = STF_CAT_EXCLUSIVE;
-        json_object_object_add(link, "type", json_object_new_string("exclusive"));
-        goto parsenames;
+    if (result == 0)
+        input->eof = true;
+
+    input->len += result;
+}
+
+// Called by the tokenizer when it needs more input.
+static void input_refill(struct stf_input *input, void *arg)
+{
+    stf_input_compact(input);
+    input_read(input, arg);
+}
+
+// Start reading from an offset in a regular file.
+static void input_seek(struct stf_input *input, struct stf_file *file, size_t offset)
+{
+    if (file->mapped) {
+        input->pos  = offset;
+        input->mark = offset;
+        return;
     }
 
-    // Unindexed, but need to check if it's numeric or date.
-    if (def[length-1] == '|'
-            && def[length-2] != '%'
-            && def[length-2] != '@'
-            && def[length-2] != '#') {
-        names = strndup(def, length - 1);
-        type = STF_CAT_UNINDEXED;
-        json_object_object_add(link, "type", json_object_new_string("unindexed"));
-        goto parsenames;
+    if (lseek(file->fd, offset, SEEK_SET) == -1) {
+        err(EXIT_FAILURE, "failed to seek input");
     }
 
-    // I don't need to check for escape characters here, because if it's not a
-    // real value, the pipe would be escaped.
-    if ((value = strstr(def, "@|"))) {
-        names = strndup(def, value - def);
-        type  = STF_CAT_DATE;
-        json_object_object_add(link, "type", json_object_new_string("date"));
-        value += 2;
-        goto parsenames;
+    input->base = offset;
+    input->len  = 0;
+    input->pos  = 0;
+    input->mark = 0;
+}
+
+// Read everything that's left into the buffer.
+static void input_slurp(struct stf_input *input, struct stf_file *file)
+{
+    while (!input->eof)
+        input_read(input, file);
+}
+
+// Look ahead from offset to the end of the block, and check whether any
+// category is defined after an item. This follows the same rules as
+// find_stf_blocks().
+static bool categories_follow_items(const struct stf_input *input, size_t offset)
+{
+    struct stf_input view = {
+        .data       = input->data + offset,
+        .len        = input->len - offset,
+        .eof        = true,
+        .scan_tag   = input->scan_tag,
+    };
+    struct stf_chunk chunk;
+    bool header = false;
+    bool items = false;
+    bool initem = false;
+    bool incategory = false;
+
+    while (stf_read_chunk(&view, &chunk) != -1) {
+        switch (chunk.id) {
+            case STF_TAG_STF:
+                // The offset might be just before this block's header.
+                if (header || items)
+                    return false;
+
+                header = true;
+                break;
+            case STF_TAG_ITEM:
+                if (!incategory)
+                    initem = items = true;
+                break;
+            case STF_TAG_END_ITEM:
+                initem = false;
+                break;
+            case STF_TAG_CATEGORY:
+                if (initem)
+                    break;
+
+                if (items)
+                    return true;
+
+                incategory = true;
+                break;
+            case STF_TAG_END_CATEGORY:
+                if (!initem)
+                    incategory = false;
+                break;
+            default:
+                break;
+        }
     }
 
-    if ((value = strstr(def, "#|"))) {
-        names = strndup(def, value - def);
-        type  = STF_CAT_NUMERIC;
-        json_object_object_add(link, "type", json_object_new_string("numeric"));
-        value += 2;
-        goto parsenames;
+    return false;
+}
+
+static void input_close(struct stf_input *input, struct stf_file *file)
+{
+    stats.inputbytes += input->base + input->len;
+
+    if (file->mapped) {
+        munmap(input->data, input->len);
+    } else {
+        free(input->data);
     }
 
-    errx(EXIT_FAILURE, "could not determine type of link %s", def);
+    if (file->fd != STDIN_FILENO)
+        close(file->fd);
+
+    if (file->inotify != -1)
+        close(file->inotify);
+}
+
+// Categories and items are built from these values, then written out as
+// soon as they're complete. They're allocated from the scratch arena, so
+// there's nothing to free, and the writer produces exactly the same text as
+// json-c, which can still be used instead with -J.
+enum stf_value_type {
+    STF_VALUE_STRING,
+    STF_VALUE_ARRAY,
+    STF_VALUE_OBJECT,
+    STF_VALUE_NUMBER,           // The string is it's decimal digits.
+};
+
+struct stf_value {
+    enum stf_value_type type;
+    const char *key;            // The name of this object member.
+    struct stf_value *next;     // The next array element or object member.
+    struct stf_slice string;
+    struct stf_value *head;     // The array elements or object members.
+    struct stf_value *tail;
+    bool shared;                // A name that's likely to be repeated.
+    bool date;                  // A STF_JSON_DATE_FORMAT timestamp.
+};
+
+// The arena only returns NULL if it couldn't get another block.
+static char *arena_strndup(struct stf_arena *arena, const char *s, size_t len)
+{
+    char *copy = stf_arena_strndup(arena, s, len);
+
+    if (copy == NULL)
+        err(EXIT_FAILURE, "failed to allocate a string");
+
+    return copy;
+}
+
+static struct stf_value *value_new(struct stf_arena *arena, enum stf_value_type type)
+{
+    struct stf_value *value = stf_arena_alloc(arena, sizeof *value);
+
+    if (value == NULL)
+        err(EXIT_FAILURE, "failed to allocate a value");
+
+    memset(value, 0, sizeof *value);
+
+    value->type = type;
+    return value;
+}
 
-parsenames:
+// The string must remain valid until the value has been written.
+static struct stf_value *value_new_string_len(struct stf_arena *arena, const char *string, size_t len)
+{
+    struct stf_value *value = value_new(arena, STF_VALUE_STRING);
+
+    value->string.data = string;
+    value->string.len  = len;
+    return value;
+}
+
+static struct stf_value *value_new_string(struct stf_arena *arena, const char *string)
+{
+    return value_new_string_len(arena, string, strlen(string));
+}
+
+static struct stf_value *value_new_number(struct stf_arena *arena, uint64_t number)
+{
+    struct stf_value *value;
+    char digits[32];
 
-    // Each link is an array element like {name: "Date", type: "", value: "12/12/123" }
-    //fprintf(stderr, "parsing category %s, names=%s, value=%s\n", def, names, value);
+    snprintf(digits, sizeof digits, "%" PRIu64, number);
 
-    if ((token = strtok(names, ";")) == NULL) {
-        errx(EXIT_FAILURE, "A category must have a name");
+    value = value_new_string_len(arena, arena_strndup(arena, digits, strlen(digits)), strlen(digits));
+    value->type = STF_VALUE_NUMBER;
+    return value;
+}
+
+// Category names, attributes and link types are repeated, so they can be
+// written once and referenced in binary output.
+static struct stf_value *value_new_name(struct stf_arena *arena, const char *string, size_t len)
+{
+    struct stf_value *value = value_new_string_len(arena, string, len);
+
+    value->shared = true;
+    return value;
+}
+
+static void value_array_add(struct stf_value *array, struct stf_value *value)
+{
+    if (array->tail) {
+        array->tail->next = value;
+    } else {
+        array->head = value;
     }
 
-    json_object_object_add(link, "name", json_object_new_string(token));
+    array->tail = value;
+}
+
+// Like json-c, adding a key that already exists replaces the value, but it
+// keeps it's original position.
+static void value_object_add(struct stf_value *object, const char *key, struct stf_value *value)
+{
+    value->key = key;
+
+    for (struct stf_value **member = &object->head; *member; member = &(*member)->next) {
+        if (strcmp((*member)->key, key) == 0) {
+            value->next = (*member)->next;
+
+            if (object->tail == *member)
+                object->tail = value;
 
-    if ((token = strtok(NULL, ";")) != NULL) {
-        json_object_object_add(link, "shortname", json_object_new_string(token));
+            *member = value;
+            return;
+        }
     }
 
-    if ((token = strtok(NULL, ";")) != NULL) {
-        struct json_object *alsomatch = json_object_new_array();
-        do {
-            json_object_array_add(alsomatch, json_object_new_string(token));
-        } while ((token = strtok(NULL, ";")));
+    value_array_add(object, value);
+}
 
-        json_object_object_add(link, "alsomatch", alsomatch);
+static struct stf_value *value_object_get(const struct stf_value *object, const char *key)
+{
+    for (struct stf_value *member = object->head; member; member = member->next) {
+        if (strcmp(member->key, key) == 0)
+            return member;
     }
 
-    if (value) {
-        char *unescaped = strdupa(value);
-        char timestamp[128];
-        struct tm parsed = {0};
+    return NULL;
+}
+
+static bool value_equals(const struct stf_value *value, const char *string)
+{
+    return value
+        && value->type == STF_VALUE_STRING
+        && value->string.len == strlen(string)
+        && memcmp(value->string.data, string, value->string.len) == 0;
+}
+
+// A growable buffer for output text.
+struct stf_buffer {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+static char *buffer_reserve(struct stf_buffer *buffer, size_t len)
+{
+    if (buffer->data == NULL || buffer->size - buffer->len < len) {
+        while (buffer->size - buffer->len < len || buffer->size == 0)
+            buffer->size = buffer->size ? buffer->size * 2 : 4096;
 
-        // First remove all the escaped chars.
-        for (char *p = unescaped; *p = *value++;) {
-            if (*p != '%')
-                p++;
-            if (*p == ';')
-                unescaped = p + 1;
+        if ((buffer->data = realloc(buffer->data, buffer->size)) == NULL) {
+            err(EXIT_FAILURE, "failed to allocate output buffer");
         }
-        switch (type) {
-            case STF_CAT_DATE:
-                // Parse the date with the current format.
-                strptime(unescaped, kLotusDateFmt[dateformat], &parsed);
-                if (strftime(timestamp, sizeof timestamp, JSON_DATE_FORMAT, &parsed) == 0) {
-                    errx(EXIT_FAILURE, "failed to format timestamp for JSON");
-                }
-                // fprintf(stderr, "DATE %s => %s\n", unescaped, timestamp);
-                json_object_object_add(link, "value", json_object_new_string(timestamp));
-                break;
-            default:
-                errx(EXIT_FAILURE, "didn't expect this type to have a value");
+
+        stats.buffergrowth++;
+    }
+
+    return buffer->data + buffer->len;
+}
+
+static void buffer_append(struct stf_buffer *buffer, const char *data, size_t len)
+{
+    memcpy(buffer_reserve(buffer, len), data, len);
+    buffer->len += len;
+}
+
+static void buffer_puts(struct stf_buffer *buffer, const char *string)
+{
+    buffer_append(buffer, string, strlen(string));
+}
+
+static void buffer_indent(struct stf_buffer *buffer, int level)
+{
+    memset(buffer_reserve(buffer, level * 2), ' ', level * 2);
+    buffer->len += level * 2;
+}
+
+static void buffer_write(struct stf_buffer *buffer, FILE *out)
+{
+    if (buffer->len)
+        fwrite(buffer->data, 1, buffer->len, out);
+}
+
+static void buffer_free(struct stf_buffer *buffer)
+{
+    free(buffer->data);
+    memset(buffer, 0, sizeof *buffer);
+}
+
+// The escapes json-c uses, zero if the character can be copied.
+#define U 'u'
+static const char kJsonEscapes[256] = {
+    U,   U,   U,   U,   U,   U,   U,   U,   'b', 't', 'n', U,   'f', 'r', U,   U,
+    U,   U,   U,   U,   U,   U,   U,   U,   U,   U,   U,   U,   U,   U,   U,   U,
+    ['"'] = '"', ['\\'] = '\\', ['/'] = '/',
+};
+#undef U
+
+static void buffer_json_string(struct stf_buffer *buffer, const char *string, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) string;
+    const unsigned char *end = p + len;
+    const unsigned char *run;
+    char *out;
+
+    buffer_append(buffer, "\"", 1);
+
+    while (p < end) {
+        // Copy everything that doesn't need escaping at once.
+        for (run = p; p < end && kJsonEscapes[*p] == 0; p++)
+            ;
+
+        buffer_append(buffer, (const char *) run, p - run);
+
+        if (p == end)
+            break;
+
+        // Room for the nul sprintf() adds.
+        out = buffer_reserve(buffer, 7);
+
+        if (kJsonEscapes[*p] == 'u') {
+            sprintf(out, "\\u00%02x", *p);
+            buffer->len += 6;
+        } else {
+            out[0] = '\\';
+            out[1] = kJsonEscapes[*p];
+            buffer->len += 2;
         }
+
+        p++;
+    }
+
+    buffer_append(buffer, "\"", 1);
+}
+
+static void buffer_json_value(struct stf_buffer *buffer, const struct stf_value *value, bool pretty, int level)
+{
+    if (value->type == STF_VALUE_STRING) {
+        buffer_json_string(buffer, value->string.data, value->string.len);
+        return;
+    }
+
+    if (value->type == STF_VALUE_NUMBER) {
+        buffer_append(buffer, value->string.data, value->string.len);
+        return;
+    }
+
+    buffer_puts(buffer, value->type == STF_VALUE_OBJECT
+                            ? pretty ? "{\n" : "{"
+                            : pretty ? "[\n" : "[");
+
+    for (const struct stf_value *child = value->head; child; child = child->next) {
+        if (pretty)
+            buffer_indent(buffer, level + 1);
+
+        if (value->type == STF_VALUE_OBJECT) {
+            buffer_json_string(buffer, child->key, strlen(child->key));
+            buffer_append(buffer, ":", 1);
+        }
+
+        buffer_json_value(buffer, child, pretty, level + 1);
+
+        if (child->next)
+            buffer_append(buffer, ",", 1);
+
+        if (pretty)
+            buffer_append(buffer, "\n", 1);
     }
 
-    json_object_array_add(links, link);
-    free(names);
-    return;
+    if (pretty)
+        buffer_indent(buffer, level);
+
+    buffer_append(buffer, value->type == STF_VALUE_OBJECT ? "}" : "]", 1);
+}
+
+// Build the equivalent json-c object.
+static struct json_object *value_to_json(const struct stf_value *value)
+{
+    struct json_object *result;
+
+    switch (value->type) {
+        case STF_VALUE_STRING:
+            return json_object_new_string_len(value->string.data, value->string.len);
+        case STF_VALUE_NUMBER:
+            return json_object_new_int64(strtoll(value->string.data, NULL, 10));
+        case STF_VALUE_ARRAY:
+            result = json_object_new_array();
+
+            for (const struct stf_value *child = value->head; child; child = child->next)
+                json_object_array_add(result, value_to_json(child));
+
+            return result;
+        case STF_VALUE_OBJECT:
+            result = json_object_new_object();
+
+            for (const struct stf_value *child = value->head; child; child = child->next)
+                json_object_object_add(result, child->key, value_to_json(child));
+
+            return result;
+    }
+
+    return NULL;
 }
 
+// CBOR (RFC 8949) major types.
 enum {
-    STF_STATE_NONE,
-    STF_STATE_ROOT,
-    STF_STATE_CATEGORY,
-    STF_STATE_CATEGORY_COND,
-    STF_STATE_CATEGORY_ACTIONS,
-    STF_STATE_ITEM,
-    STF_STATE_NOTE,
+    CBOR_UINT,
+    CBOR_NEGINT,
+    CBOR_BYTES,
+    CBOR_TEXT,
+    CBOR_ARRAY,
+    CBOR_MAP,
+    CBOR_TAG,
 };
 
-int main(int argc, char **argv)
+#define CBOR_TAG_EPOCH      1       // A date as seconds since the epoch.
+#define CBOR_TAG_STRINGREF  25      // A reference to an earlier string.
+#define CBOR_TAG_NAMESPACE  256     // String references inside this are valid.
+#define CBOR_BREAK          0xff    // The end of an indefinite length array.
+#define CBOR_INDEFINITE     31
+
+static void buffer_cbor_head(struct stf_buffer *buffer, int major, uint64_t n)
 {
-    int state;
-    int dateformat;
-    char *tag, *value;
-
-    struct json_object *root;
-    struct json_object *stf;
-    struct json_object *items;
-    struct json_object *categories;
-    struct json_object *itemcats;
-    struct json_object *category;
-    struct json_object *item;
-    struct json_object *attributes;
-    struct json_object *assignopts;
-    struct json_object *include;
-    struct json_object *exclude;
-
-    root = json_object_new_array();
-    state = STF_STATE_NONE;
-
-    // The default dateformat is 1, Appendix B-6
-    dateformat = 1;
-
-    while (read_stf_chunk(&tag, &value) != -1) {
-        // Just print comments to stderr.
-
-        if (strcmp(tag, "S") == 0) {
-            if (value) {
-                fprintf(stderr, "Comment: %s\n", value);
-            }
-            free(tag);
-            free(value);
-            continue;
-        }
+    unsigned char *out = (unsigned char *) buffer_reserve(buffer, 9);
+    int size = n < 24 ? 0 : n <= UINT8_MAX ? 1 : n <= UINT16_MAX ? 2 : n <= UINT32_MAX ? 4 : 8;
 
-      reparse:
+    // The argument follows in big endian if it doesn't fit in the head.
+    out[0] = major << 5 | (size ? 24U + __builtin_ctz(size) : n);
 
-        switch (state) {
-            case STF_STATE_NONE:
-                if (strcmp(tag, "STF") == 0) {
-                    char timestamp[128];
-                    struct tm date;
+    for (int i = 0; i < size; i++)
+        out[size - i] = n >> (i * 8);
 
-                    state = STF_STATE_ROOT;
-                    stf = json_object_new_object();
+    buffer->len += size + 1;
+}
 
-                    // Appendix B-5
-                    if (strptime(value, "%D;%T;002", &date) == NULL) {
-                        errx(EXIT_FAILURE, "failed to parse STF header tag, '%s'", value);
-                    }
+static void buffer_cbor_indefinite(struct stf_buffer *buffer, int major)
+{
+    buffer_append(buffer, (char []) { major << 5 | CBOR_INDEFINITE }, 1);
+}
 
-                    if (strftime(timestamp, sizeof timestamp, JSON_DATE_FORMAT, &date) == 0) {
-                        errx(EXIT_FAILURE, "failed to format timestamp for JSON");
-                    }
+// Only real dates can be tagged, anything else is left as a string.
+static bool cbor_epoch(const char *timestamp, size_t len, int64_t *epoch)
+{
+    struct tm date = {0};
+    char string[64];
+    char check[64];
+    time_t seconds;
+    char *end;
 
-                    json_object_object_add(stf, "timestamp", json_object_new_string(timestamp));
-                    categories = json_object_new_array();
-                    items = json_object_new_array();
-                    json_object_object_add(stf, "categories", categories);
-                    json_object_object_add(stf, "items", items);
-                    json_object_array_add(root, stf);
-                    break;
-                }
+    snprintf(string, sizeof string, "%.*s", (int) len, timestamp);
 
-                errx(EXIT_FAILURE, "[none] unexpected tag %s here", tag);
-                break;
-            case STF_STATE_ROOT:
-                // Change date format, Appendix B-6
-                if (strcmp(tag, "d") == 0) {
-                    dateformat = strtoul(value, NULL, 10);
+    if ((end = strptime(string, STF_JSON_DATE_FORMAT, &date)) == NULL || *end != '\0')
+        return false;
 
-                    if (dateformat < 1 || dateformat > 12)
-                        errx(EXIT_FAILURE, "invalid date format requested");
+    // If it's out of range, it won't be the same date after normalizing.
+    seconds = timegm(&date);
 
-                    break;
-                }
+    if (strftime(check, sizeof check, STF_JSON_DATE_FORMAT, &date) == 0 || strcmp(check, string) != 0)
+        return false;
 
-                // Start a new category definition.
-                if (strcmp(tag, "C") == 0) {
-                    state = STF_STATE_CATEGORY;
-                    category = json_object_new_object();
-                    attributes = json_object_new_array();
-
-                    // The category name has symbols declaring it's type, see
-                    // Appendix B-11.
-                    // TODO: parse name.
-                    json_object_object_add(category, "name", json_object_new_string(value));
-                    json_object_object_add(category, "attributes", attributes);
-                    json_object_array_add(categories, category);
-                    break;
-                }
+    *epoch = seconds;
+    return true;
+}
 
-                // Start a new item definition
-                if (strcmp(tag, "I") == 0) {
-                    state = STF_STATE_ITEM;
-                    item = json_object_new_object();
-                    itemcats = json_object_new_array();
-                    json_object_object_add(item, "categories", itemcats);
-                    json_object_array_add(items, item);
-                    break;
-                }
+static void buffer_cbor_timestamp(struct stf_buffer *buffer, const char *timestamp, size_t len)
+{
+    int64_t epoch;
 
-                // End of current file, new one begins.
-                if (strcmp(tag, "STF") == 0) {
-                    state = STF_STATE_NONE;
-                    goto reparse;
-                }
+    if (!cbor_epoch(timestamp, len, &epoch)) {
+        buffer_cbor_head(buffer, CBOR_TEXT, len);
+        buffer_append(buffer, timestamp, len);
+        return;
+    }
 
-                errx(EXIT_FAILURE, "[root] unexpected tag %s here", tag);
-                break;
-            case STF_STATE_CATEGORY:
-                // Undocumented, but Agenda 2.0b will generate these.
-                if (strcmp(tag, "r") == 0) {
-                    char *attrtag;
-                    char *attrval;
+    buffer_cbor_head(buffer, CBOR_TAG, CBOR_TAG_EPOCH);
 
-                    json_object_array_add(attributes, json_object_new_string(value));
+    if (epoch < 0) {
+        buffer_cbor_head(buffer, CBOR_NEGINT, -1 - epoch);
+    } else {
+        buffer_cbor_head(buffer, CBOR_UINT, epoch);
+    }
+}
 
-                    if (read_stf_chunk(&attrtag, &attrval) == -1) {
-                        errx(EXIT_FAILURE, "failed to find end-attribute tag");
-                    }
+// Values are formatted without string references, because they depend on
+// everything written before. Names that can be referenced are marked by
+// writing them as byte strings instead, which are never used otherwise, and
+// output_cbor() replaces them in the order they're actually written.
+static void buffer_cbor_value(struct stf_buffer *buffer, const struct stf_value *value)
+{
+    size_t count = 0;
 
-                    if (strcmp(attrtag, ";") != 0 || attrval != NULL) {
-                        errx(EXIT_FAILURE, "invalid end-attribute tag");
-                    }
+    if (value->type == STF_VALUE_STRING) {
+        if (value->date) {
+            buffer_cbor_timestamp(buffer, value->string.data, value->string.len);
+            return;
+        }
 
-                    free(attrtag);
-                    free(attrval);
-                    break;
-                }
+        buffer_cbor_head(buffer, value->shared ? CBOR_BYTES : CBOR_TEXT, value->string.len);
+        buffer_append(buffer, value->string.data, value->string.len);
+        return;
+    }
 
-                // End of category.
-                if (strcmp(tag, ".") == 0) {
-                    category    = NULL;
-                    attributes  = NULL;
-                    state       = STF_STATE_ROOT;
-                    break;
-                }
+    if (value->type == STF_VALUE_NUMBER) {
+        buffer_cbor_head(buffer, CBOR_UINT, strtoull(value->string.data, NULL, 10));
+        return;
+    }
 
-                // Category note.
-                if (strcmp(tag, "F") == 0) {
-                    json_object_object_add(category, "note", json_object_new_string(value));
-                    break;
-                }
+    for (const struct stf_value *child = value->head; child; child = child->next)
+        count++;
 
-                // Undocumented tags.
-                if (strcmp(tag, "p") == 0 || strcmp(tag, "a") == 0) {
-                    assignopts = json_object_new_object();
-                    include    = json_object_new_array();
-                    exclude    = json_object_new_array();
-                    json_object_object_add(assignopts, "include", include);
-                    json_object_object_add(assignopts, "exclude", exclude);
-
-                    if (strcmp(tag, "a") == 0) {
-                        state = STF_STATE_CATEGORY_ACTIONS;
-                        json_object_object_add(category, "actions", assignopts);
-                    } else {
-                        state = STF_STATE_CATEGORY_COND;
-                        json_object_object_add(category, "conditions", assignopts);
-                    }
-                    break;
-                }
+    buffer_cbor_head(buffer, value->type == STF_VALUE_OBJECT ? CBOR_MAP : CBOR_ARRAY, count);
 
-                errx(EXIT_FAILURE, "[category] unexpected tag %s here", tag);
-                break;
-            case STF_STATE_CATEGORY_ACTIONS:
-            case STF_STATE_CATEGORY_COND:
-                if (strcmp(tag, "C") == 0) {
-                    char *condtag;
-                    char *condval;
-                    if (read_stf_chunk(&condtag, &condval) == -1) {
-                        errx(EXIT_FAILURE, "failed to find end-category tag");
-                    }
-                    if (strcmp(condtag, "+") == 0) {
-                        json_object_array_add(include, json_object_new_string(value));
-                    } else if (strcmp(condtag, "-") == 0) {
-                        json_object_array_add(exclude, json_object_new_string(value));
-                    } else {
-                        errx(EXIT_FAILURE, "failed to find assignment type");
-                    }
-                    free(condtag);
-                    free(condval);
-                    break;
-                }
-                if (strcmp(tag, ";") == 0) {
-                    state = STF_STATE_CATEGORY;
-                    assignopts = NULL;
-                    include    = NULL;
-                    exclude    = NULL;
-                    break;
-                }
-                errx(EXIT_FAILURE, "[categoryopts] unexpected tag %s here", tag);
-            case STF_STATE_ITEM:
-                if (strcmp(tag, "T") == 0) {
-                    json_object_object_add(item, "text", json_object_new_string(value));
-                    break;
-                }
-                if (strcmp(tag, "N") == 0) {
-                    json_object_object_add(item, "note", json_object_new_string(value));
-                    break;
-                }
-                // Any associated category
-                if (strcmp(tag, "C") == 0) {
-                    parse_item_category(itemcats, dateformat, value);
-                    break;
-                }
-                if (strcmp(tag, ".") == 0) {
-                    break;
-                }
-                if (strcmp(tag, "!") == 0) {
-                    state = STF_STATE_ROOT;
-                    item = NULL;
-                    itemcats = NULL;
-                    break;
-                }
-                errx(EXIT_FAILURE, "[item] unexpected tag %s here", tag);
-            default:
-                errx(EXIT_FAILURE, "unexpected state transition, %s", tag);
+    for (const struct stf_value *child = value->head; child; child = child->next) {
+        if (value->type == STF_VALUE_OBJECT) {
+            buffer_cbor_head(buffer, CBOR_BYTES, strlen(child->key));
+            buffer_puts(buffer, child->key);
         }
 
-        free(tag);
-        free(value);
+        buffer_cbor_value(buffer, child);
+    }
+}
+
+// The value may point into the input buffer, so has to be copied.
+static struct stf_value *chunk_json_value(struct stf_arena *arena, const struct stf_chunk *chunk)
+{
+    struct stf_slice value = stf_chunk_value(arena, chunk);
+
+    if (chunk->escaped && value.data == NULL)
+        err(EXIT_FAILURE, "failed to decode a value");
+
+    if (!chunk->escaped)
+        value.data = arena_strndup(arena, value.data ? value.data : "", value.len);
+
+    return value_new_string_len(arena, value.data, value.len);
+}
+
+// Only some fields of each item can be printed with a projection, and any
+// work for the other fields is skipped as early as possible.
+struct stf_projection {
+    bool text;
+    bool note;
+    bool links;             // Every category link.
+    bool definitions;       // The category definitions in each block.
+    char **categories;      // Only links to these categories.
+    size_t count;
+};
+
+static void add_projection_link(struct stf_projection *projection, const char *name)
+{
+    if ((projection->categories = realloc(projection->categories, ++projection->count * sizeof(char *))) == NULL)
+        err(EXIT_FAILURE, "failed to allocate projection");
+
+    if ((projection->categories[projection->count - 1] = strdup(name)) == NULL)
+        err(EXIT_FAILURE, "failed to allocate projection");
+}
+
+// Parse a list of fields and add them to the projection.
+static void add_projection(struct stf_projection *projection, const char *spec)
+{
+    char *fields = strdup(spec);
+    char *saveptr;
+
+    if (fields == NULL)
+        err(EXIT_FAILURE, "failed to allocate projection");
+
+    for (char *field = strtok_r(fields, ",", &saveptr); field; field = strtok_r(NULL, ",", &saveptr)) {
+        if (strcmp(field, "text") == 0) {
+            projection->text = true;
+        } else if (strcmp(field, "note") == 0) {
+            projection->note = true;
+        } else if (strcmp(field, "categories") == 0) {
+            projection->links = true;
+        } else if (strcmp(field, "definitions") == 0) {
+            projection->definitions = true;
+        } else if (strncmp(field, "category:", 9) == 0) {
+            add_projection_link(projection, field + 9);
+        } else {
+            errx(EXIT_FAILURE, "could not understand field '%s'", field);
+        }
+    }
+
+    free(fields);
+}
+
+static void free_projection(struct stf_projection *projection)
+{
+    for (size_t i = 0; i < projection->count; i++)
+        free(projection->categories[i]);
+
+    free(projection->categories);
+}
+
+static bool projection_has_link(const struct stf_projection *projection, const char *name)
+{
+    if (projection == NULL || projection->links)
+        return true;
+
+    for (size_t i = 0; i < projection->count; i++) {
+        if (strcmp(projection->categories[i], name) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+// Make a copy of an item with only the projected fields. The copy shares
+// strings and arrays with the original.
+static struct stf_value *project_item(struct stf_arena *arena, const struct stf_projection *projection, const struct stf_value *item)
+{
+    struct stf_value *result = value_new(arena, STF_VALUE_OBJECT);
+    struct stf_value *copy;
+
+    for (const struct stf_value *member = item->head; member; member = member->next) {
+        if (strcmp(member->key, "categories") == 0) {
+            if (!projection->links && !projection->count)
+                continue;
+
+            copy = value_new(arena, STF_VALUE_ARRAY);
+
+            for (const struct stf_value *link = member->head; link; link = link->next) {
+                struct stf_value *linkcopy;
+
+                // Names are always nul terminated.
+                if (!projection_has_link(projection, value_object_get(link, "name")->string.data))
+                    continue;
+
+                linkcopy  = value_new(arena, STF_VALUE_OBJECT);
+                *linkcopy = *link;
+                linkcopy->next = NULL;
+                value_array_add(copy, linkcopy);
+            }
+        } else if ((strcmp(member->key, "text") == 0 && projection->text)
+                || (strcmp(member->key, "note") == 0 && projection->note)) {
+            copy  = value_new(arena, member->type);
+            *copy = *member;
+            copy->next = NULL;
+        } else {
+            continue;
+        }
+
+        value_object_add(result, member->key, copy);
+    }
+
+    return result;
+}
+
+// Output is written as each {STF} block, category or item is completed.
+//
+// In document mode, the text of each category and item is kept until the
+// block ends, so that they can be printed in the right order.
+//
+// In streaming mode, each category and item is printed as soon as it's
+// complete rather than keeping the entire block in memory. The output is
+// identical, but only if categories precede items in each {STF} block, so
+// any block where they don't is kept until it ends, like in a document.
+//
+// In lines mode, each category and item is printed as a compact object on
+// it's own line, tagged with the {STF} block it came from.
+//
+// The same structure can be written as compact JSON, or as CBOR. In CBOR,
+// lines are a sequence of maps, and arrays that are streamed have an
+// indefinite length.
+enum {
+    OUTPUT_DOCUMENT,
+    OUTPUT_STREAM,
+    OUTPUT_LINES,
+};
+
+enum {
+    ENCODING_JSON,
+    ENCODING_COMPACT,
+    ENCODING_CBOR,
+};
+
+enum {
+    STREAM_SECTION_NONE,
+    STREAM_SECTION_CATEGORIES,
+    STREAM_SECTION_ITEMS,
+};
+
+// Strings that have been written in CBOR, so that names can be replaced with
+// references. Every string long enough to be worth referencing is numbered,
+// but only names are kept.
+struct stf_stringref {
+    size_t offset;      // Into strings, unused if len is zero.
+    size_t len;
+    uint64_t index;
+};
+
+struct stf_stringrefs {
+    struct stf_buffer strings;
+    struct stf_stringref *slots;
+    size_t nslots;
+    size_t nnames;
+    uint64_t count;     // Number of strings numbered so far.
+};
+
+struct stf_output {
+    int format;     // Document, stream or lines.
+    int encoding;   // JSON, compact JSON or CBOR.
+    bool jsonc;     // Use json-c to format categories and items.
+    FILE *out;
+    int blocks;     // Number of {STF} blocks started, including any before
+                    // a checkpoint.
+    int written;    // Number of {STF} blocks started by this output.
+    bool open;      // Whether a block was started and not ended.
+    bool buffered;  // Whether this block is kept until it ends when streaming.
+    int section;    // Which array is currently open.
+    int count;      // Number of elements written to that array.
+    char timestamp[128];
+    struct stf_buffer *events;      // If set, record everything here instead.
+    struct stf_buffer element;      // The text of the current element.
+    struct stf_buffer categories;   // The text of all categories and items
+    struct stf_buffer items;        // in this block, in document mode.
+    int ncategories;
+    int nitems;
+    struct stf_buffer cbor;         // CBOR waiting to be written.
+    struct stf_stringrefs stringrefs;
+};
+
+// References are only used if they're shorter than the string.
+static size_t stringref_minimum(uint64_t index)
+{
+    return index < 24 ? 3 : index <= UINT8_MAX ? 4 : index <= UINT16_MAX ? 5 : index <= UINT32_MAX ? 7 : 11;
+}
+
+static struct stf_stringref *stringref_slot(struct stf_stringrefs *table, const char *string, size_t len)
+{
+    size_t i = stf_hash_string(string, len) & (table->nslots - 1);
+
+    for (; table->slots[i].len; i = (i + 1) & (table->nslots - 1)) {
+        if (table->slots[i].len == len && memcmp(table->strings.data + table->slots[i].offset, string, len) == 0)
+            break;
+    }
+
+    return &table->slots[i];
+}
+
+static void stringref_add(struct stf_stringrefs *table, const char *string, size_t len, uint64_t index)
+{
+    struct stf_stringref *old = table->slots;
+    size_t nold = table->nslots;
+
+    // Keep the table at most half full.
+    if (table->nnames >= table->nslots / 2) {
+        table->nslots = table->nslots ? table->nslots * 2 : 256;
+        table->slots  = calloc(table->nslots, sizeof *table->slots);
+
+        if (table->slots == NULL)
+            err(EXIT_FAILURE, "failed to grow string table");
+
+        for (size_t i = 0; i < nold; i++) {
+            if (old[i].len)
+                *stringref_slot(table, table->strings.data + old[i].offset, old[i].len) = old[i];
+        }
+
+        free(old);
+    }
+
+    *stringref_slot(table, string, len) = (struct stf_stringref) {
+        .offset = table->strings.len,
+        .len    = len,
+        .index  = index,
+    };
+
+    buffer_append(&table->strings, string, len);
+
+    table->nnames++;
+}
+
+// Start a new namespace, references can't refer to anything before this.
+static void output_cbor_namespace(struct stf_output *output)
+{
+    struct stf_stringrefs *table = &output->stringrefs;
+
+    if (table->slots)
+        memset(table->slots, 0, table->nslots * sizeof *table->slots);
+
+    table->strings.len  = 0;
+    table->nnames       = 0;
+    table->count        = 0;
+
+    buffer_cbor_head(&output->cbor, CBOR_TAG, CBOR_TAG_NAMESPACE);
+}
+
+// Write a string, numbering it if a decoder would, and replacing it with a
+// reference if it's a name that's already been written.
+static void output_cbor_string(struct stf_output *output, const char *string, size_t len, bool name)
+{
+    struct stf_stringrefs *table = &output->stringrefs;
+    struct stf_stringref *ref;
+
+    if (name && table->nnames && (ref = stringref_slot(table, string, len))->len) {
+        buffer_cbor_head(&output->cbor, CBOR_TAG, CBOR_TAG_STRINGREF);
+        buffer_cbor_head(&output->cbor, CBOR_UINT, ref->index);
+        return;
+    }
+
+    if (len >= stringref_minimum(table->count)) {
+        if (name)
+            stringref_add(table, string, len, table->count);
+
+        table->count++;
+    }
+
+    buffer_cbor_head(&output->cbor, CBOR_TEXT, len);
+    buffer_append(&output->cbor, string, len);
+}
+
+// Write values formatted by buffer_cbor_value(), with references to names.
+static void output_cbor(struct stf_output *output, const char *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    const unsigned char *end = p + len;
+
+    while (p < end) {
+        const unsigned char *head = p;
+        int major = *p >> 5;
+        int info = *p++ & 31;
+        uint64_t n = info < 24 ? info : 0;
+
+        for (int i = 0; info >= 24 && i < 1 << (info - 24); i++)
+            n = n << 8 | *p++;
+
+        if (major == CBOR_BYTES || major == CBOR_TEXT) {
+            output_cbor_string(output, (const char *) p, n, major == CBOR_BYTES);
+            p += n;
+        } else {
+            buffer_append(&output->cbor, (const char *) head, p - head);
+        }
+    }
+}
+
+static void output_flush_cbor(struct stf_output *output)
+{
+    buffer_write(&output->cbor, output->out);
+
+    output->cbor.len = 0;
+}
+
+static void output_cbor_timestamp(struct stf_output *output, const char *timestamp)
+{
+    int64_t epoch;
+
+    if (!cbor_epoch(timestamp, strlen(timestamp), &epoch)) {
+        output_cbor_string(output, timestamp, strlen(timestamp), false);
+        return;
+    }
+
+    buffer_cbor_timestamp(&output->cbor, timestamp, strlen(timestamp));
+}
+
+// Format a category or item as it would appear in the document, or as a
+// compact object in lines mode.
+static void format_element(struct stf_output *output, const struct stf_value *value)
+{
+    bool pretty = output->format != OUTPUT_LINES && output->encoding == ENCODING_JSON;
+    int depth = pretty ? 3 : 0;
+    struct json_object *obj;
+    const char *json;
+
+    output->element.len = 0;
+
+    if (output->encoding == ENCODING_CBOR) {
+        buffer_cbor_value(&output->element, value);
+        return;
+    }
+
+    buffer_indent(&output->element, depth);
+
+    if (!output->jsonc) {
+        buffer_json_value(&output->element, value, pretty, depth);
+        return;
+    }
+
+    obj  = value_to_json(value);
+    json = json_object_to_json_string_ext(obj, pretty ? JSON_C_TO_STRING_PRETTY : JSON_C_TO_STRING_PLAIN);
+
+    // Strings are escaped, so any newline is formatting.
+    for (const char *nl; (nl = strchr(json, '\n')); json = nl + 1) {
+        buffer_append(&output->element, json, nl - json + 1);
+        buffer_indent(&output->element, depth);
+    }
+
+    buffer_puts(&output->element, json);
+    json_object_put(obj);
+}
+
+static void stream_close_section(struct stf_output *output)
+{
+    if (output->section == STREAM_SECTION_NONE)
+        return;
+
+    switch (output->encoding) {
+        case ENCODING_JSON:
+            fprintf(output->out, "%s    ]", output->count ? "\n" : "");
+            break;
+        case ENCODING_COMPACT:
+            fputc(']', output->out);
+            break;
+        case ENCODING_CBOR:
+            fputc(CBOR_BREAK, output->out);
+            break;
+    }
+}
+
+static void stream_open_section(struct stf_output *output, int section)
+{
+    const char *name = section == STREAM_SECTION_ITEMS ? "items" : "categories";
+
+    if (output->section == section)
+        return;
+
+    if (output->section > section)
+        errx(EXIT_FAILURE, "categories must precede items in streaming mode");
+
+    // The document always has a categories array, even if empty.
+    if (section == STREAM_SECTION_ITEMS && output->section == STREAM_SECTION_NONE)
+        stream_open_section(output, STREAM_SECTION_CATEGORIES);
+
+    stream_close_section(output);
+
+    switch (output->encoding) {
+        case ENCODING_JSON:
+            fprintf(output->out, ",\n    \"%s\":[\n", name);
+            break;
+        case ENCODING_COMPACT:
+            fprintf(output->out, ",\"%s\":[", name);
+            break;
+        case ENCODING_CBOR:
+            output_cbor_string(output, name, strlen(name), true);
+            buffer_cbor_indefinite(&output->cbor, CBOR_ARRAY);
+            output_flush_cbor(output);
+            break;
+    }
+
+    output->section = section;
+    output->count   = 0;
+}
+
+static void stream_begin_stf(struct stf_output *output)
+{
+    switch (output->encoding) {
+        case ENCODING_JSON:
+            fprintf(output->out, "%s  {\n    \"timestamp\":\"%s\"", output->written > 1 ? ",\n" : "[\n", output->timestamp);
+            break;
+        case ENCODING_COMPACT:
+            fprintf(output->out, "%s{\"timestamp\":\"%s\"", output->written > 1 ? "," : "[", output->timestamp);
+            break;
+        case ENCODING_CBOR:
+            // The whole document is one namespace.
+            if (output->written == 1) {
+                output_cbor_namespace(output);
+                buffer_cbor_indefinite(&output->cbor, CBOR_ARRAY);
+            }
+
+            // There's always a timestamp, categories and items.
+            buffer_cbor_head(&output->cbor, CBOR_MAP, 3);
+            output_cbor_string(output, "timestamp", strlen("timestamp"), true);
+            output_cbor_timestamp(output, output->timestamp);
+            output_flush_cbor(output);
+            break;
+    }
+
+    output->section = STREAM_SECTION_NONE;
+    output->count   = 0;
+}
+
+// Write the categories or items of a block in document mode.
+static void output_elements(struct stf_output *output, struct stf_buffer *buffer)
+{
+    if (output->encoding != ENCODING_CBOR) {
+        buffer_write(buffer, output->out);
+        return;
+    }
+
+    output_cbor(output, buffer->data, buffer->len);
+    output_flush_cbor(output);
+}
+
+// Blocks that can't be streamed are written the way a document would be.
+static int output_format(const struct stf_output *output)
+{
+    return output->buffered ? OUTPUT_DOCUMENT : output->format;
+}
+
+static void output_end_stf(struct stf_output *output)
+{
+    if (!output->open)
+        return;
+
+    output->open = false;
+
+    switch (output_format(output)) {
+        case OUTPUT_DOCUMENT:
+            // This is exactly what streaming mode would have printed.
+            stream_begin_stf(output);
+            stream_open_section(output, STREAM_SECTION_CATEGORIES);
+            output_elements(output, &output->categories);
+            output->count = output->ncategories;
+            stream_open_section(output, STREAM_SECTION_ITEMS);
+            output_elements(output, &output->items);
+            output->count = output->nitems;
+
+            // fallthrough
+        case OUTPUT_STREAM:
+            stream_open_section(output, STREAM_SECTION_ITEMS);
+            stream_close_section(output);
+
+            if (output->encoding == ENCODING_JSON)
+                fprintf(output->out, "\n  }");
+
+            if (output->encoding == ENCODING_COMPACT)
+                fputc('}', output->out);
+
+            break;
+    }
+}
+
+// Output can be recorded, so that it can be formatted in another thread and
+// then replayed in order. Each event is the section followed by the text.
+struct stf_event {
+    int section;            // STREAM_SECTION_NONE for a new {STF} block.
+    size_t len;
+};
+
+static void record_event(struct stf_output *output, int section, const char *data, size_t len)
+{
+    struct stf_event event = {
+        .section    = section,
+        .len        = len,
+    };
+
+    buffer_append(output->events, (const char *) &event, sizeof event);
+    buffer_append(output->events, data, len);
+}
+
+static void output_begin_stf(struct stf_output *output, const char *timestamp, bool buffered)
+{
+    if (output->events) {
+        record_event(output, STREAM_SECTION_NONE, timestamp, strlen(timestamp));
+        return;
+    }
+
+    output_end_stf(output);
+
+    output->blocks++;
+    output->written++;
+    output->open = true;
+    output->buffered = buffered && output->format == OUTPUT_STREAM;
+
+    snprintf(output->timestamp, sizeof output->timestamp, "%s", timestamp);
+
+    switch (output_format(output)) {
+        case OUTPUT_DOCUMENT:
+            output->categories.len  = 0;
+            output->items.len       = 0;
+            output->ncategories     = 0;
+            output->nitems          = 0;
+            break;
+        case OUTPUT_STREAM:
+            stream_begin_stf(output);
+            break;
+    }
+}
+
+// Write the formatted text of a category or item.
+static void output_write_element(struct stf_output *output, int section, const char *data, size_t len)
+{
+    struct stf_buffer *buffer;
+
+    switch (output_format(output)) {
+        case OUTPUT_DOCUMENT:
+            buffer = section == STREAM_SECTION_ITEMS ? &output->items : &output->categories;
+
+            if ((section == STREAM_SECTION_ITEMS ? output->nitems++ : output->ncategories++)) {
+                if (output->encoding == ENCODING_JSON)
+                    buffer_append(buffer, ",\n", 2);
+
+                if (output->encoding == ENCODING_COMPACT)
+                    buffer_append(buffer, ",", 1);
+            }
+
+            buffer_append(buffer, data, len);
+            return;
+        case OUTPUT_STREAM:
+            stream_open_section(output, section);
+
+            if (output->encoding == ENCODING_CBOR) {
+                output_cbor(output, data, len);
+                output_flush_cbor(output);
+                break;
+            }
+
+            if (output->count++)
+                fputs(output->encoding == ENCODING_JSON ? ",\n" : ",", output->out);
+
+            fwrite(data, 1, len, output->out);
+            break;
+        case OUTPUT_LINES:
+            // Each line is a separate namespace, so can be decoded alone.
+            if (output->encoding == ENCODING_CBOR) {
+                output_cbor_namespace(output);
+                buffer_cbor_head(&output->cbor, CBOR_MAP, 3);
+                output_cbor_string(output, "stf", strlen("stf"), true);
+                buffer_cbor_head(&output->cbor, CBOR_UINT, output->blocks - 1);
+                output_cbor_string(output, "timestamp", strlen("timestamp"), true);
+                output_cbor_timestamp(output, output->timestamp);
+                output_cbor_string(output, section == STREAM_SECTION_ITEMS ? "item" : "category",
+                                           section == STREAM_SECTION_ITEMS ? 4 : 8, true);
+                output_cbor(output, data, len);
+                output_flush_cbor(output);
+                break;
+            }
+
+            fprintf(output->out, "{\"stf\":%d,\"timestamp\":\"%s\",\"%s\":%.*s}\n",
+                    output->blocks - 1,
+                    output->timestamp,
+                    section == STREAM_SECTION_ITEMS ? "item" : "category",
+                    (int) len,
+                    data);
+            break;
+    }
+
+    // Let consumers start work immediately.
+    fflush(output->out);
+}
+
+// Write a completed category or item.
+static void output_element(struct stf_output *output, int section, const struct stf_value *value)
+{
+    uint64_t start = stats_clock();
+
+    format_element(output, value);
+
+    if (output->events) {
+        record_event(output, section, output->element.data, output->element.len);
+    } else {
+        output_write_element(output, section, output->element.data, output->element.len);
+    }
+
+    stats.formatting += stats_clock() - start;
+}
+
+// Write everything recorded by another output.
+// If the events start a block, buffered is whether it's kept until it ends.
+static void output_replay(struct stf_output *output, const struct stf_buffer *events, bool buffered)
+{
+    struct stf_event event;
+    char timestamp[128];
+
+    for (size_t offset = 0; offset < events->len; offset += event.len) {
+        memcpy(&event, events->data + offset, sizeof event);
+
+        offset += sizeof event;
+
+        if (event.section != STREAM_SECTION_NONE) {
+            output_write_element(output, event.section, events->data + offset, event.len);
+            continue;
+        }
+
+        snprintf(timestamp, sizeof timestamp, "%.*s", (int) event.len, events->data + offset);
+
+        output_begin_stf(output, timestamp, buffered);
+    }
+}
+
+static void output_finish(struct stf_output *output)
+{
+    output_end_stf(output);
+
+    if (output->format == OUTPUT_LINES)
+        return;
+
+    switch (output->encoding) {
+        case ENCODING_JSON:
+            fputs(output->written ? "\n]\n" : "[\n]\n", output->out);
+            break;
+        case ENCODING_COMPACT:
+            fputs(output->written ? "]\n" : "[]\n", output->out);
+            break;
+        case ENCODING_CBOR:
+            if (output->written == 0) {
+                output_cbor_namespace(output);
+                buffer_cbor_indefinite(&output->cbor, CBOR_ARRAY);
+            }
+
+            buffer_append(&output->cbor, (char []) { CBOR_BREAK }, 1);
+            output_flush_cbor(output);
+            break;
+    }
+}
+
+static void output_free(struct stf_output *output)
+{
+    buffer_free(&output->element);
+    buffer_free(&output->categories);
+    buffer_free(&output->items);
+    buffer_free(&output->cbor);
+    buffer_free(&output->stringrefs.strings);
+    free(output->stringrefs.slots);
+}
+
+// Items can be selected with filters, so that the ones that aren't wanted
+// are never formatted. An item has to match every filter to be written.
+enum {
+    FILTER_CATEGORY,    // category:NAME        Assigned to this category.
+    FILTER_TEXT,        // text:REGEX           The text matches this regex.
+    FILTER_BEFORE,      // NAME<TIMESTAMP       Date category value is before.
+    FILTER_AFTER,       // NAME>TIMESTAMP       Date category value is after.
+};
+
+struct stf_filter {
+    int type;
+    char *name;
+    char timestamp[128];
+    regex_t regex;
+    struct stf_filter *next;
+};
+
+// Parse a filter and add it to the list.
+static void add_filter(struct stf_filter **filters, const char *spec)
+{
+    struct stf_filter *filter = calloc(1, sizeof *filter);
+    const char *op;
+    int error;
+
+    if (filter == NULL)
+        err(EXIT_FAILURE, "failed to allocate filter");
+
+    if (strncmp(spec, "category:", 9) == 0) {
+        filter->type = FILTER_CATEGORY;
+
+        if ((filter->name = strdup(spec + 9)) == NULL)
+            err(EXIT_FAILURE, "failed to allocate filter");
+    } else if (strncmp(spec, "text:", 5) == 0) {
+        filter->type = FILTER_TEXT;
+
+        if ((error = regcomp(&filter->regex, spec + 5, REG_EXTENDED | REG_NOSUB)) != 0) {
+            char message[256];
+            regerror(error, &filter->regex, message, sizeof message);
+            errx(EXIT_FAILURE, "invalid filter regex '%s', %s", spec + 5, message);
+        }
+    } else if ((op = strpbrk(spec, "<>"))) {
+        filter->type = *op == '<' ? FILTER_BEFORE : FILTER_AFTER;
+        filter->name = strndup(spec, op - spec);
+
+        // Timestamps are compared as strings, so must use the same format.
+        if (strcmp(op + 1, "now") == 0) {
+            time_t now = time(NULL);
+            struct tm date;
+
+            strftime(filter->timestamp, sizeof filter->timestamp, STF_JSON_DATE_FORMAT, gmtime_r(&now, &date));
+        } else {
+            snprintf(filter->timestamp, sizeof filter->timestamp, "%s", op + 1);
+        }
+    } else {
+        errx(EXIT_FAILURE, "could not understand filter '%s'", spec);
+    }
+
+    // Keep them in the order specified.
+    while (*filters)
+        filters = &(*filters)->next;
+
+    *filters = filter;
+}
+
+static void free_filters(struct stf_filter *filters)
+{
+    for (struct stf_filter *next; filters; filters = next) {
+        next = filters->next;
+
+        if (filters->type == FILTER_TEXT)
+            regfree(&filters->regex);
+
+        free(filters->name);
+        free(filters);
+    }
+}
+
+// Timestamps are compared as strings, so a prefix of the filter timestamp is
+// before it.
+static bool match_timestamp(const struct stf_filter *filter, const char *timestamp, size_t len)
+{
+    int order = strncmp(timestamp, filter->timestamp, len);
+
+    if (order == 0 && strlen(filter->timestamp) > len)
+        order = -1;
+
+    return filter->type == FILTER_BEFORE ? order < 0 : order > 0;
+}
+
+static bool match_filter(struct stf_arena *arena, const struct stf_filter *filter, const struct stf_value *item)
+{
+    const struct stf_value *links = value_object_get(item, "categories");
+    const struct stf_value *text;
+    char *string;
+
+    switch (filter->type) {
+        case FILTER_TEXT:
+            if ((text = value_object_get(item, "text")) == NULL)
+                return false;
+
+            // The text might contain nul characters, so only match up to
+            // the first one.
+            string = arena_strndup(arena, text->string.data, text->string.len);
+
+            return regexec(&filter->regex, string, 0, NULL, 0) == 0;
+        case FILTER_CATEGORY:
+        case FILTER_BEFORE:
+        case FILTER_AFTER:
+            for (const struct stf_value *link = links->head; link; link = link->next) {
+                const struct stf_value *value;
+
+                if (!value_equals(value_object_get(link, "name"), filter->name))
+                    continue;
+
+                if (filter->type == FILTER_CATEGORY)
+                    return true;
+
+                if ((value = value_object_get(link, "value")) == NULL)
+                    continue;
+
+                if (match_timestamp(filter, value->string.data, value->string.len))
+                    return true;
+            }
+            return false;
+    }
+
+    return false;
+}
+
+static bool match_filters(struct stf_arena *arena, const struct stf_filter *filters, const struct stf_value *item)
+{
+    for (; filters; filters = filters->next) {
+        if (!match_filter(arena, filters, item))
+            return false;
+    }
+
+    return true;
+}
+
+// Agenda can keep appending items to the same export, so the position after
+// the last complete item or category can be saved and the next conversion
+// can start from there.
+#define CHECKPOINT_MAGIC "stfjson-checkpoint2"
+#define CHECKPOINT_FORMAT " %zu %d %d %" SCNu32 " %ju %ju %zu %jd.%ld"
+#define CHECKPOINT_BLOCK 65536
+
+struct stf_checkpoint {
+    const char *filename;
+    size_t saved;           // The offset last saved to the file.
+    size_t offset;          // Just after the last complete item or category.
+    int dateformat;         // The date format in effect there.
+    int block;              // Index of the enclosing {STF} block.
+    char timestamp[128];    // From it's header.
+    uint32_t hash;          // Of everything before hashed, to check the
+    size_t hashed;          // file was appended to rather than changed.
+    dev_t dev;              // The file it was saved for, and it's size and
+    ino_t ino;              // mtime then.
+    size_t size;
+    struct timespec mtime;
+};
+
+// This is FNV-1a like stf_hash_string(), but it can carry on from where it
+// left off, so only what was added since the last save has to be read.
+static bool checkpoint_hash(struct stf_checkpoint *checkpoint, struct stf_file *file, size_t offset)
+{
+    char block[CHECKPOINT_BLOCK];
+    ssize_t len;
+
+    while (checkpoint->hashed < offset) {
+        len = offset - checkpoint->hashed < sizeof block ? offset - checkpoint->hashed : sizeof block;
+
+        if (pread(file->fd, block, len, checkpoint->hashed) != len)
+            return false;
+
+        for (ssize_t i = 0; i < len; i++) {
+            checkpoint->hash ^= (unsigned char) block[i];
+            checkpoint->hash *= 16777619u;
+        }
+
+        checkpoint->hashed += len;
+    }
+
+    return true;
+}
+
+// Returns true if the checkpoint can be used with this input.
+static bool load_checkpoint(struct stf_checkpoint *checkpoint, struct stf_file *input)
+{
+    const char *filename = checkpoint->filename;
+    struct stat st;
+    FILE *file;
+    char timestamp[128];
+    uintmax_t dev, ino;
+    intmax_t mtime;
+    uint32_t hash;
+    bool valid;
+
+    checkpoint->hash    = 2166136261u;
+    checkpoint->hashed  = 0;
+
+    // The first conversion doesn't have a checkpoint yet.
+    if ((file = fopen(filename, "r")) == NULL) {
+        if (errno != ENOENT)
+            err(EXIT_FAILURE, "failed to open checkpoint %s", filename);
+        return false;
+    }
+
+    valid = fscanf(file, CHECKPOINT_MAGIC CHECKPOINT_FORMAT " %127[^\n]",
+                   &checkpoint->offset,
+                   &checkpoint->dateformat,
+                   &checkpoint->block,
+                   &hash,
+                   &dev,
+                   &ino,
+                   &checkpoint->size,
+                   &mtime,
+                   &checkpoint->mtime.tv_nsec,
+                   timestamp) == 10;
+
+    fclose(file);
+
+    if (!valid) {
+        warnx("ignoring invalid checkpoint %s", filename);
+        checkpoint->offset = 0;
+        return false;
+    }
+
+    snprintf(checkpoint->timestamp, sizeof checkpoint->timestamp, "%s", timestamp);
+
+    checkpoint->mtime.tv_sec = mtime;
+
+    // It has to be the same file, and unless it grew, it can't have been
+    // touched. Then everything before the offset has to be the same.
+    if (fstat(input->fd, &st) != 0
+            || st.st_dev != (dev_t) dev
+            || st.st_ino != (ino_t) ino
+            || (size_t) st.st_size < checkpoint->size
+            || (size_t) st.st_size < checkpoint->offset
+            || ((size_t) st.st_size == checkpoint->size
+                && (st.st_mtim.tv_sec != checkpoint->mtime.tv_sec
+                    || st.st_mtim.tv_nsec != checkpoint->mtime.tv_nsec))
+            || !checkpoint_hash(checkpoint, input, checkpoint->offset)
+            || checkpoint->hash != hash) {
+        warnx("input has changed since checkpoint %s, starting again", filename);
+        checkpoint->hash    = 2166136261u;
+        checkpoint->hashed  = 0;
+        checkpoint->offset  = 0;
+        return false;
+    }
+
+    checkpoint->saved = checkpoint->offset;
+    return true;
+}
+
+static void save_checkpoint(struct stf_checkpoint *checkpoint, struct stf_file *input)
+{
+    const char *filename = checkpoint->filename;
+    struct stat st;
+    char *temp;
+    FILE *file;
+
+    // Nothing new has been completed.
+    if (checkpoint->offset == checkpoint->saved)
+        return;
+
+    // If the input can't be read again, the checkpoint couldn't be checked.
+    if (fstat(input->fd, &st) != 0 || !checkpoint_hash(checkpoint, input, checkpoint->offset)) {
+        warnx("can't read %s again, not saving checkpoint %s", input->name, filename);
+        return;
+    }
+
+    // Write a new checkpoint and then replace the old one, so it's never
+    // left incomplete.
+    if (asprintf(&temp, "%s.tmp", filename) == -1)
+        err(EXIT_FAILURE, "failed to allocate checkpoint name");
+
+    if ((file = fopen(temp, "w")) == NULL)
+        err(EXIT_FAILURE, "failed to create checkpoint %s", temp);
+
+    fprintf(file, CHECKPOINT_MAGIC " %zu %d %d %" PRIu32 " %ju %ju %zu %jd.%09ld %s\n",
+            checkpoint->offset,
+            checkpoint->dateformat,
+            checkpoint->block,
+            checkpoint->hash,
+            (uintmax_t) st.st_dev,
+            (uintmax_t) st.st_ino,
+            (size_t) st.st_size,
+            (intmax_t) st.st_mtim.tv_sec,
+            st.st_mtim.tv_nsec,
+            checkpoint->timestamp);
+
+    if (fclose(file) != 0 || rename(temp, filename) != 0)
+        err(EXIT_FAILURE, "failed to write checkpoint %s", filename);
+
+    checkpoint->saved = checkpoint->offset;
+    free(temp);
+}
+
+// An index of the items in a file can be kept next to it, so that repeated
+// queries only parse the items that might match the filters. It's a header
+// followed by each table in order, in the native byte order.
+#define INDEX_MAGIC "stfidx1"
+
+// Dates are stored as YYYYMMDDhhmmss rather than seconds, so that they can be
+// converted back to exactly the same timestamp, even if it's not a real date.
+// This has to match STF_JSON_DATE_FORMAT.
+#define INDEX_DATE_FORMAT "%d-%d-%dT%d:%d:%dZ"
+
+enum {
+    INDEX_ITEM_GAP  = 1 << 0,   // Something other than an item comes before it.
+};
+
+enum {
+    INDEX_LINK_DATE = 1 << 0,   // The link has a date value.
+};
+
+struct stf_index_header {
+    char magic[8];
+    uint64_t size;          // The index is only used if the input size and
+    int64_t mtime;          // modification time haven't changed.
+    int64_t mtimensec;
+    uint64_t nitems;
+    uint64_t nlinks;
+    uint64_t ncategories;
+    uint64_t npostings;
+    uint64_t nstrings;
+};
+
+struct stf_index_item {
+    uint64_t offset;        // Of the {I} tag.
+    uint32_t len;           // Up to the end of the {!} tag.
+    uint32_t flags;
+    uint32_t link;          // The first of nlinks in the link table.
+    uint32_t nlinks;
+};
+
+struct stf_index_link {
+    uint32_t category;
+    uint32_t flags;
+    int64_t date;
+};
+
+struct stf_index_category {
+    uint64_t name;          // Offset in the string table.
+    uint32_t namelen;
+    uint32_t npostings;
+    uint64_t postings;      // The first of npostings items linked to it.
+};
+
+struct stf_index {
+    struct stf_index_header header;
+    struct stf_index_item *items;
+    struct stf_index_link *links;
+    struct stf_index_category *categories;
+    uint32_t *postings;
+    struct stf_buffer strings;
+    void *map;              // Everything points into this if it was loaded.
+    size_t maplen;
+    uint32_t *slots;        // Category hash table, only used while building.
+    size_t nslots;
+    size_t end;             // Of the last item added.
+};
+
+// Tables grow whenever the count reaches a power of two.
+static void *index_grow(void *table, uint64_t count, size_t size)
+{
+    if (count & (count - 1))
+        return table;
+
+    if ((table = realloc(table, (count ? count * 2 : 1) * size)) == NULL)
+        err(EXIT_FAILURE, "failed to grow index");
+
+    return table;
+}
+
+static uint32_t *index_slot(struct stf_index *index, const char *name, size_t len)
+{
+    size_t i = stf_hash_string(name, len) & (index->nslots - 1);
+
+    for (; index->slots[i]; i = (i + 1) & (index->nslots - 1)) {
+        const struct stf_index_category *category = &index->categories[index->slots[i] - 1];
+
+        if (category->namelen == len && memcmp(index->strings.data + category->name, name, len) == 0)
+            break;
+    }
+
+    return &index->slots[i];
+}
+
+// Find the id of a category name, adding it if it hasn't been seen before.
+static uint32_t index_category(struct stf_index *index, const char *name, size_t len)
+{
+    struct stf_index_category *category;
+    uint32_t *slot;
+
+    // Keep the table at most half full.
+    if (index->header.ncategories >= index->nslots / 2) {
+        free(index->slots);
+
+        index->nslots = index->nslots ? index->nslots * 2 : 256;
+        index->slots  = calloc(index->nslots, sizeof *index->slots);
+
+        if (index->slots == NULL)
+            err(EXIT_FAILURE, "failed to grow index");
+
+        for (uint32_t i = 0; i < index->header.ncategories; i++) {
+            category = &index->categories[i];
+            *index_slot(index, index->strings.data + category->name, category->namelen) = i + 1;
+        }
+    }
+
+    if (*(slot = index_slot(index, name, len)))
+        return *slot - 1;
+
+    index->categories = index_grow(index->categories, index->header.ncategories, sizeof *index->categories);
+
+    category = &index->categories[index->header.ncategories];
+    category->name      = index->strings.len;
+    category->namelen   = len;
+    category->npostings = 0;
+    category->postings  = 0;
+
+    buffer_append(&index->strings, name, len);
+
+    return (*slot = ++index->header.ncategories) - 1;
+}
+
+// The item is at offset in data, which is the whole input.
+static void index_add_item(struct stf_index *index, const struct stf_value *item, const char *data, size_t offset, size_t end)
+{
+    const struct stf_value *links = value_object_get(item, "categories");
+    struct stf_index_item *entry;
+    bool gap = false;
+
+    if (index->header.nitems >= UINT32_MAX || end - offset > UINT32_MAX)
+        errx(EXIT_FAILURE, "input is too large to index");
+
+    // Anything but whitespace since the last item would have been a chunk.
+    for (size_t i = index->end; i < offset && !gap; i++)
+        gap = !isspace((unsigned char) data[i]);
+
+    index->items = index_grow(index->items, index->header.nitems, sizeof *index->items);
+
+    entry = &index->items[index->header.nitems++];
+    entry->offset   = offset;
+    entry->len      = end - offset;
+    entry->flags    = gap ? INDEX_ITEM_GAP : 0;
+    entry->link     = index->header.nlinks;
+    entry->nlinks   = 0;
+
+    index->end = end;
+
+    for (const struct stf_value *link = links->head; link; link = link->next) {
+        const struct stf_value *name = value_object_get(link, "name");
+        const struct stf_value *value = value_object_get(link, "value");
+        struct stf_index_link *record;
+        int year, mon, mday, hour, min, sec;
+
+        if (index->header.nlinks >= UINT32_MAX)
+            errx(EXIT_FAILURE, "input is too large to index");
+
+        index->links = index_grow(index->links, index->header.nlinks, sizeof *index->links);
+
+        record = &index->links[index->header.nlinks++];
+        record->category = index_category(index, name->string.data, name->string.len);
+        record->flags    = 0;
+        record->date     = 0;
+
+        if (value) {
+            if (sscanf(value->string.data, INDEX_DATE_FORMAT, &year, &mon, &mday, &hour, &min, &sec) != 6)
+                errx(EXIT_FAILURE, "failed to index timestamp %s", value->string.data);
+
+            record->flags = INDEX_LINK_DATE;
+            record->date  = ((((year * 100LL + mon) * 100 + mday) * 100 + hour) * 100 + min) * 100 + sec;
+        }
+
+        entry->nlinks++;
+    }
+}
+
+static void index_timestamp(int64_t date, char *timestamp, size_t size)
+{
+    struct tm tm = {0};
+
+    tm.tm_sec  = date % 100;
+    tm.tm_min  = date / 100 % 100;
+    tm.tm_hour = date / 10000 % 100;
+    tm.tm_mday = date / 1000000 % 100;
+    tm.tm_mon  = date / 100000000 % 100 - 1;
+    tm.tm_year = date / 10000000000LL - 1900;
+
+    if (strftime(timestamp, size, STF_JSON_DATE_FORMAT, &tm) == 0) {
+        errx(EXIT_FAILURE, "failed to format timestamp for JSON");
+    }
+}
+
+// Returns true if the index can be used with this input, otherwise it's ready
+// to be built.
+static bool load_index(struct stf_index *index, const char *filename, const struct stat *input)
+{
+    struct stf_index_header *header;
+    struct stat st;
+    uint64_t expected;
+    int fd;
+
+    memset(index, 0, sizeof *index);
+
+    memcpy(index->header.magic, INDEX_MAGIC, sizeof index->header.magic);
+
+    index->header.size      = input->st_size;
+    index->header.mtime     = input->st_mtim.tv_sec;
+    index->header.mtimensec = input->st_mtim.tv_nsec;
+
+    // The first query doesn't have an index yet.
+    if ((fd = open(filename, O_RDONLY)) == -1) {
+        if (errno != ENOENT)
+            err(EXIT_FAILURE, "failed to open index %s", filename);
+        return false;
+    }
+
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof *header) {
+        close(fd);
+        goto invalid;
+    }
+
+    index->maplen = st.st_size;
+    index->map    = mmap(NULL, index->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if (index->map == MAP_FAILED)
+        err(EXIT_FAILURE, "failed to map index %s", filename);
+
+    header = index->map;
+
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof header->magic) != 0)
+        goto invalid;
+
+    // The input has changed, so it has to be built again.
+    if (header->size != index->header.size
+            || header->mtime != index->header.mtime
+            || header->mtimensec != index->header.mtimensec) {
+        munmap(index->map, index->maplen);
+        index->map = NULL;
+        return false;
+    }
+
+    if (header->nitems > UINT32_MAX
+            || header->nlinks > UINT32_MAX
+            || header->ncategories > UINT32_MAX
+            || header->npostings > UINT32_MAX
+            || header->nstrings > UINT32_MAX)
+        goto invalid;
+
+    expected = sizeof *header
+             + header->nitems * sizeof *index->items
+             + header->nlinks * sizeof *index->links
+             + header->ncategories * sizeof *index->categories
+             + header->npostings * sizeof *index->postings
+             + header->nstrings;
+
+    if (expected != index->maplen)
+        goto invalid;
+
+    index->header       = *header;
+    index->items        = (void *) (header + 1);
+    index->links        = (void *) (index->items + header->nitems);
+    index->categories   = (void *) (index->links + header->nlinks);
+    index->postings     = (void *) (index->categories + header->ncategories);
+    index->strings.data = (void *) (index->postings + header->npostings);
+    index->strings.len  = header->nstrings;
+
+    // Make sure everything refers to something that exists.
+    for (uint32_t i = 0; i < header->nitems; i++) {
+        const struct stf_index_item *item = &index->items[i];
+
+        if (item->offset > header->size
+                || item->len > header->size - item->offset
+                || (i && item->offset < index->items[i - 1].offset + index->items[i - 1].len)
+                || (uint64_t) item->link + item->nlinks > header->nlinks)
+            goto invalid;
+    }
+
+    for (uint32_t i = 0; i < header->nlinks; i++) {
+        if (index->links[i].category >= header->ncategories)
+            goto invalid;
+    }
+
+    for (uint32_t i = 0; i < header->ncategories; i++) {
+        const struct stf_index_category *category = &index->categories[i];
+
+        if (category->name > header->nstrings
+                || category->namelen > header->nstrings - category->name
+                || category->postings > header->npostings
+                || category->npostings > header->npostings - category->postings)
+            goto invalid;
+    }
+
+    for (uint32_t i = 0; i < header->npostings; i++) {
+        if (index->postings[i] >= header->nitems)
+            goto invalid;
+    }
+
+    return true;
+
+  invalid:
+    warnx("ignoring invalid index %s", filename);
+
+    if (index->map)
+        munmap(index->map, index->maplen);
+
+    index->map = NULL;
+    index->header.nitems = index->header.nlinks = index->header.ncategories = 0;
+    index->header.npostings = index->header.nstrings = 0;
+    return false;
+}
+
+static void save_index(struct stf_index *index, const char *filename)
+{
+    uint32_t *last = malloc((index->header.ncategories + 1) * sizeof *last);
+    uint64_t postings = 0;
+    char *temp;
+    FILE *file;
+
+    if (last == NULL)
+        err(EXIT_FAILURE, "failed to allocate index");
+
+    // Each category lists the items linked to it, counted first and then
+    // filled in.
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t i = 0; i < index->header.ncategories; i++)
+            last[i] = UINT32_MAX;
+
+        for (uint32_t i = 0; i < index->header.nitems; i++) {
+            const struct stf_index_item *item = &index->items[i];
+
+            for (uint32_t j = item->link; j < item->link + item->nlinks; j++) {
+                struct stf_index_category *category = &index->categories[index->links[j].category];
+
+                // An item can be linked to the same category more than once.
+                if (last[index->links[j].category] == i)
+                    continue;
+
+                last[index->links[j].category] = i;
+
+                if (pass == 0) {
+                    category->npostings++;
+                } else {
+                    index->postings[category->postings + category->npostings++] = i;
+                }
+            }
+        }
+
+        if (pass == 0) {
+            for (uint32_t i = 0; i < index->header.ncategories; i++) {
+                index->categories[i].postings  = postings;
+                postings += index->categories[i].npostings;
+                index->categories[i].npostings = 0;
+            }
+
+            if ((index->postings = malloc((postings + 1) * sizeof *index->postings)) == NULL)
+                err(EXIT_FAILURE, "failed to allocate index");
+        }
+    }
+
+    index->header.npostings = postings;
+    index->header.nstrings  = index->strings.len;
+
+    free(last);
+
+    // Write a new index and then replace the old one, so it's never left
+    // incomplete.
+    if (asprintf(&temp, "%s.tmp", filename) == -1)
+        err(EXIT_FAILURE, "failed to allocate index name");
+
+    if ((file = fopen(temp, "w")) == NULL)
+        err(EXIT_FAILURE, "failed to create index %s", temp);
+
+    fwrite(&index->header, sizeof index->header, 1, file);
+    fwrite(index->items, sizeof *index->items, index->header.nitems, file);
+    fwrite(index->links, sizeof *index->links, index->header.nlinks, file);
+    fwrite(index->categories, sizeof *index->categories, index->header.ncategories, file);
+    fwrite(index->postings, sizeof *index->postings, index->header.npostings, file);
+    buffer_write(&index->strings, file);
+
+    if (ferror(file) || fclose(file) != 0 || rename(temp, filename) != 0)
+        err(EXIT_FAILURE, "failed to write index %s", filename);
+
+    free(temp);
+}
+
+static void free_index(struct stf_index *index)
+{
+    if (index->map) {
+        munmap(index->map, index->maplen);
+    } else {
+        free(index->items);
+        free(index->links);
+        free(index->categories);
+        free(index->postings);
+        buffer_free(&index->strings);
+    }
+
+    free(index->slots);
+}
+
+static bool index_match_date(const struct stf_index *index, const struct stf_filter *filter, const struct stf_index_item *item, uint32_t category)
+{
+    char timestamp[128];
+
+    for (uint32_t i = item->link; i < item->link + item->nlinks; i++) {
+        if (index->links[i].category != category || !(index->links[i].flags & INDEX_LINK_DATE))
+            continue;
+
+        index_timestamp(index->links[i].date, timestamp, sizeof timestamp);
+
+        if (match_timestamp(filter, timestamp, strlen(timestamp)))
+            return true;
+    }
+
+    return false;
+}
+
+// Count how many of the filters each item matches, returning the number of
+// filters checked. Text filters are left until the item is parsed.
+static uint32_t index_filters(const struct stf_index *index, const struct stf_filter *filters, uint32_t *hits)
+{
+    uint32_t count = 0;
+
+    for (; filters; filters = filters->next) {
+        uint32_t category;
+
+        if (filters->type == FILTER_TEXT)
+            continue;
+
+        count++;
+
+        for (category = 0; category < index->header.ncategories; category++) {
+            if (index->categories[category].namelen == strlen(filters->name)
+                    && memcmp(index->strings.data + index->categories[category].name,
+                              filters->name,
+                              index->categories[category].namelen) == 0)
+                break;
+        }
+
+        // No items are linked to it.
+        if (category == index->header.ncategories)
+            continue;
+
+        for (uint64_t i = 0; i < index->categories[category].npostings; i++) {
+            uint32_t item = index->postings[index->categories[category].postings + i];
+
+            if (filters->type == FILTER_CATEGORY
+                    || index_match_date(index, filters, &index->items[item], category))
+                hits[item]++;
+        }
+    }
+
+    return count;
+}
+
+// Links with exactly the same names share the strings from the symbol table,
+// so they can be compared by address.
+struct described_link {
+    const char *type;           // Always from kStfLinkTypeNames.
+    const char *name;
+};
+
+// Everything needed to convert some STF data, so that independent blocks can
+// be converted at the same time.
+struct stf_parser {
+    struct stf_context stf;
+    struct stf_file file;
+    struct stf_output output;
+    FILE *comments;
+    FILE *quarantine;                           // For anything skipped, if set.
+    const struct stf_filter *filters;
+    const struct stf_projection *projection;    // What to print, or NULL for everything.
+    const struct stf_projection *filtered;      // What the filters use, if lazy.
+    struct stf_checkpoint *checkpoint;          // Updated after each item, if set.
+    struct stf_index *index;                    // Every item is added, if set.
+    const struct stf_input *whole;              // The file, if parsed in parts.
+    struct stf_value *item;                     // The item being parsed.
+    struct stf_value *links;
+    bool normalized;                            // Link to categories by id.
+    struct described_link *described;            // The first link to each id
+    size_t ndescribed;                          // in this block.
+};
+
+// When following a file, save the checkpoint before waiting for more.
+static void parser_idle(void *arg)
+{
+    struct stf_parser *parser = arg;
+
+    if (parser->checkpoint)
+        save_checkpoint(parser->checkpoint, &parser->file);
+
+    if (parser->quarantine)
+        fflush(parser->quarantine);
+}
+
+// Add the counters from the parser to the statistics for this thread.
+static void parser_stats(struct stf_parser *parser)
+{
+    struct stf_counters *counters = &parser->stf.counters;
+
+    for (int tag = 0; tag < STF_TAG_COUNT; tag++) {
+        stats.chunks[tag] += counters->chunks[tag];
+        stats.bytes[tag]  += counters->bytes[tag];
+    }
+
+    stats.tokenizing    += counters->tokenizing;
+    stats.links         += counters->links;
+    stats.dates         += counters->dates;
+    stats.arenablocks   += parser->stf.scratch.blocks + parser->stf.symbols.arena.blocks;
+    stats.symbolgrowth  += parser->stf.symbols.growth;
+
+    *counters = (struct stf_counters) { .timing = counters->timing };
+
+    parser->stf.scratch.blocks          = 0;
+    parser->stf.symbols.arena.blocks    = 0;
+    parser->stf.symbols.growth          = 0;
+}
+
+static void update_checkpoint(struct stf_parser *parser)
+{
+    if (parser->checkpoint == NULL)
+        return;
+
+    parser->checkpoint->offset      = parser->stf.input.base + parser->stf.input.pos;
+    parser->checkpoint->dateformat  = parser->stf.dateformat;
+    parser->checkpoint->block       = parser->output.blocks - 1;
+
+    snprintf(parser->checkpoint->timestamp, sizeof parser->checkpoint->timestamp, "%s", parser->output.timestamp);
+}
+
+// In normalized output, only the first link to each category in a block has
+// it's names, later links just have the id and value. The type is included
+// if it's different, and the names if a link has a different shortname or
+// alsomatch. The members are relinked in place, so this has to be the last
+// thing done to the item.
+static void normalize_links(struct stf_parser *parser, struct stf_value *links)
+{
+    for (struct stf_value *link = links->head; link; link = link->next) {
+        uint64_t id = strtoull(value_object_get(link, "id")->string.data, NULL, 10);
+        const char *type = value_object_get(link, "type")->string.data;
+        const char *name = value_object_get(link, "name")->string.data;
+        struct stf_value *member = link->head;
+        struct stf_value *next;
+
+        if (id >= parser->ndescribed) {
+            size_t size = parser->ndescribed ? parser->ndescribed : 256;
+
+            while (size <= id)
+                size *= 2;
+
+            if ((parser->described = realloc(parser->described, size * sizeof *parser->described)) == NULL)
+                err(EXIT_FAILURE, "failed to allocate category ids");
+
+            memset(parser->described + parser->ndescribed, 0, (size - parser->ndescribed) * sizeof *parser->described);
+
+            parser->ndescribed = size;
+        }
+
+        if (parser->described[id].name == NULL) {
+            parser->described[id].type = type;
+            parser->described[id].name = name;
+            continue;
+        }
+
+        link->head = link->tail = NULL;
+
+        for (; member; member = next) {
+            next = member->next;
+
+            if (strcmp(member->key, "type") == 0 && type == parser->described[id].type)
+                continue;
+
+            if (strcmp(member->key, "id") != 0 && strcmp(member->key, "value") != 0 && name == parser->described[id].name)
+                continue;
+
+            member->next = NULL;
+            value_array_add(link, member);
+        }
+    }
+}
+
+static void output_item(struct stf_parser *parser, struct stf_value *item)
+{
+    struct stf_value *links;
+
+    if (parser->projection)
+        item = project_item(&parser->stf.scratch, parser->projection, item);
+
+    if (parser->normalized && (links = value_object_get(item, "categories")))
+        normalize_links(parser, links);
+
+    output_element(&parser->output, STREAM_SECTION_ITEMS, item);
+}
+
+static struct stf_value *slices_value(struct stf_arena *arena, const struct stf_slice *slices, size_t count)
+{
+    struct stf_value *array = value_new(arena, STF_VALUE_ARRAY);
+
+    for (size_t i = 0; i < count; i++)
+        value_array_add(array, value_new_name(arena, slices[i].data, slices[i].len));
+
+    return array;
+}
+
+static struct stf_value *assignments_value(struct stf_arena *arena, const struct stf_assignments *assignments)
+{
+    struct stf_value *object = value_new(arena, STF_VALUE_OBJECT);
+
+    value_object_add(object, "include", slices_value(arena, assignments->include, assignments->ninclude));
+    value_object_add(object, "exclude", slices_value(arena, assignments->exclude, assignments->nexclude));
+    return object;
+}
+
+static void output_category(struct stf_parser *parser, const struct stf_category *category)
+{
+    struct stf_arena *arena = &parser->stf.scratch;
+    struct stf_value *value;
+
+    if (parser->projection && !parser->projection->definitions)
+        return;
+
+    value = value_new(arena, STF_VALUE_OBJECT);
+
+    if (parser->normalized && category->id != STF_NO_CATEGORY)
+        value_object_add(value, "id", value_new_number(arena, category->id));
+
+    value_object_add(value, "name", value_new_name(arena, category->name.data, category->name.len));
+    value_object_add(value, "attributes", slices_value(arena, category->attributes, category->nattributes));
+
+    // The other fields are in the order they first appeared.
+    for (size_t i = 0; i < category->nfields; i++) {
+        switch (category->fields[i]) {
+            case STF_CATEGORY_NOTE:
+                value_object_add(value, "note", value_new_string_len(arena, category->note.data, category->note.len));
+                break;
+            case STF_CATEGORY_CONDITIONS:
+                value_object_add(value, "conditions", assignments_value(arena, &category->conditions));
+                break;
+            case STF_CATEGORY_ACTIONS:
+                value_object_add(value, "actions", assignments_value(arena, &category->actions));
+                break;
+        }
+    }
+
+    output_element(&parser->output, STREAM_SECTION_CATEGORIES, value);
+}
+
+// Whether a block starting here has to be kept until it ends. The whole input
+// is needed to tell, which parse_stf() makes sure of when streaming.
+static bool parser_categories_follow(const struct stf_parser *parser)
+{
+    const struct stf_input *input = parser->whole ? parser->whole : &parser->stf.input;
+
+    if (parser->output.format != OUTPUT_STREAM || parser->output.events)
+        return false;
+
+    return !input->eof || categories_follow_items(input, parser->stf.input.base + parser->stf.input.pos - input->base);
+}
+
+static int parser_stf_header(struct stf_context *ctx, const char *timestamp)
+{
+    struct stf_parser *parser = ctx->arg;
+
+    // The ids start again in each block.
+    if (parser->described)
+        memset(parser->described, 0, parser->ndescribed * sizeof *parser->described);
+
+    output_begin_stf(&parser->output, timestamp, parser_categories_follow(parser));
+    return 0;
+}
+
+static int parser_category(struct stf_context *ctx, const struct stf_category *category)
+{
+    struct stf_parser *parser = ctx->arg;
+
+    // Anything still open at EOF is included in the document, unless it will
+    // be read again from the checkpoint.
+    if (!category->complete && parser->checkpoint)
+        return 0;
+
+    output_category(parser, category);
+
+    if (category->complete)
+        update_checkpoint(parser);
+
+    return 0;
+}
+
+static int parser_item_begin(struct stf_context *ctx)
+{
+    struct stf_parser *parser = ctx->arg;
+
+    parser->item  = value_new(&ctx->scratch, STF_VALUE_OBJECT);
+    parser->links = value_new(&ctx->scratch, STF_VALUE_ARRAY);
+
+    value_object_add(parser->item, "categories", parser->links);
+    return 0;
+}
+
+static int parser_item_text(struct stf_context *ctx, const struct stf_chunk *chunk)
+{
+    struct stf_parser *parser = ctx->arg;
+
+    value_object_add(parser->item, "text", chunk_json_value(&ctx->scratch, chunk));
+    return 0;
+}
+
+static int parser_item_note(struct stf_context *ctx, const struct stf_chunk *chunk)
+{
+    struct stf_parser *parser = ctx->arg;
+
+    value_object_add(parser->item, "note", chunk_json_value(&ctx->scratch, chunk));
+    return 0;
+}
+
+// Each link is an array element like {name: "Date", type: "", value: "12/12/123" }
+static int add_item_link(struct stf_parser *parser, const struct stf_projection *needed, const struct stf_link *link)
+{
+    struct stf_context *ctx = &parser->stf;
+    struct stf_arena *arena = &ctx->scratch;
+    struct stf_value *value;
+    struct stf_value *date;
+    char timestamp[128];
+
+    // Nothing else is needed if this link won't be used.
+    if (!projection_has_link(needed, link->name))
+        return 0;
+
+    value = value_new(arena, STF_VALUE_OBJECT);
+
+    if (parser->normalized)
+        value_object_add(value, "id", value_new_number(arena, link->id));
+
+    value_object_add(value, "type", value_new_name(arena, kStfLinkTypeNames[link->type], strlen(kStfLinkTypeNames[link->type])));
+    value_object_add(value, "name", value_new_name(arena, link->name, strlen(link->name)));
+
+    if (link->shortname) {
+        value_object_add(value, "shortname", value_new_name(arena, link->shortname, strlen(link->shortname)));
+    }
+
+    if (link->nalsomatch) {
+        struct stf_value *alsomatch = value_new(arena, STF_VALUE_ARRAY);
+
+        for (size_t i = 0; i < link->nalsomatch; i++)
+            value_array_add(alsomatch, value_new_name(arena, link->alsomatch[i], strlen(link->alsomatch[i])));
+
+        value_object_add(value, "alsomatch", alsomatch);
+    }
+
+    if (link->value.data) {
+        if (stf_link_timestamp(ctx, link, timestamp, sizeof timestamp) != 0)
+            return -1;
+
+        date = value_new_string(arena, arena_strndup(arena, timestamp, strlen(timestamp)));
+        date->date = true;
+
+        value_object_add(value, "value", date);
+    }
+
+    value_array_add(parser->links, value);
+    return 0;
+}
+
+static int parser_item_link(struct stf_context *ctx, const struct stf_link *link)
+{
+    return add_item_link(ctx->arg, NULL, link);
+}
+
+// In lazy mode, build the item from just the fields that are needed.
+static int build_lazy_item(struct stf_parser *parser, const struct stf_projection *needed)
+{
+    struct stf_context *ctx = &parser->stf;
+    const struct stf_item *item = &ctx->item;
+    struct stf_chunk chunk;
+    struct stf_link link;
+
+    parser_item_begin(ctx);
+
+    for (size_t i = 0; i < item->nfields; i++) {
+        if (item->fields[i] == STF_ITEM_TEXT && (!needed || needed->text)) {
+            stf_item_chunk(ctx, &item->text, &chunk);
+            value_object_add(parser->item, "text", chunk_json_value(&ctx->scratch, &chunk));
+        }
+
+        if (item->fields[i] == STF_ITEM_NOTE && (!needed || needed->note)) {
+            stf_item_chunk(ctx, &item->note, &chunk);
+            value_object_add(parser->item, "note", chunk_json_value(&ctx->scratch, &chunk));
+        }
+    }
+
+    // The links don't have to be parsed at all if none are used.
+    if (needed && !needed->links && !needed->count)
+        return 0;
+
+    for (size_t i = 0; i < item->nlinks; i++) {
+        if (stf_item_link(ctx, i, &link) != 0 || add_item_link(parser, needed, &link) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int parser_item_end(struct stf_context *ctx, bool complete)
+{
+    struct stf_parser *parser = ctx->arg;
+
+    if (!complete && parser->checkpoint)
+        return 0;
+
+    if (complete && parser->index)
+        index_add_item(parser->index, parser->item, ctx->input.data, ctx->offset, ctx->input.base + ctx->input.pos);
+
+    // The filters are tested on just the fields they use first, so only items
+    // that match are decoded.
+    if (ctx->lazy && parser->filters && build_lazy_item(parser, parser->filtered) != 0)
+        return -1;
+
+    if (match_filters(&ctx->scratch, parser->filters, parser->item)) {
+        if (ctx->lazy && build_lazy_item(parser, parser->projection) != 0)
+            return -1;
+
+        output_item(parser, parser->item);
+    }
+
+    if (complete)
+        update_checkpoint(parser);
+
+    return 0;
+}
+
+// Just print comments to stderr.
+static int parser_comment(struct stf_context *ctx, const struct stf_chunk *chunk)
+{
+    struct stf_parser *parser = ctx->arg;
+    struct stf_slice comment = stf_chunk_value(&ctx->scratch, chunk);
+
+    if (chunk->escaped && comment.data == NULL)
+        err(EXIT_FAILURE, "failed to decode a comment");
+
+    fprintf(parser->comments, "Comment: %.*s\n", STF_SLICE_FMT(comment));
+    return 0;
+}
+
+static void parser_warning(struct stf_context *ctx, const char *message)
+{
+    (void) ctx;
+    warnx("%s", message);
+}
+
+// Anything that couldn't be parsed is saved to the quarantine file as it was,
+// after a comment saying where it came from.
+static int parser_skipped(struct stf_context *ctx, size_t offset, struct stf_slice data)
+{
+    struct stf_parser *parser = ctx->arg;
+    FILE *out = parser->quarantine;
+    char note[2048];
+
+    snprintf(note, sizeof note, "skipped %zu bytes at offset %zu of %s, %s", data.len, offset, parser->file.name, ctx->error);
+
+    warnx("%s", note);
+
+    // It won't be looked at again.
+    if (parser->checkpoint && offset + data.len == ctx->input.base + ctx->input.pos)
+        update_checkpoint(parser);
+
+    if (out == NULL)
+        return 0;
+
+    // The note has to be escaped to be a comment.
+    fputs("{S}", out);
+
+    for (const char *p = note; *p; p++) {
+        fputc(*p, out);
+
+        if (*p == STF_OPEN_TAG)
+            fputc(STF_ESCAPE_TAG, out);
+    }
+
+    fputc('\n', out);
+    fwrite(data.data, 1, data.len, out);
+    fputc('\n', out);
+    return 0;
+}
+
+static const struct stf_callbacks kParserCallbacks = {
+    .on_stf_header  = parser_stf_header,
+    .on_category    = parser_category,
+    .on_item_begin  = parser_item_begin,
+    .on_item_text   = parser_item_text,
+    .on_item_note   = parser_item_note,
+    .on_item_link   = parser_item_link,
+    .on_item_end    = parser_item_end,
+    .on_comment     = parser_comment,
+    .on_warning     = parser_warning,
+    .on_skipped     = parser_skipped,
+};
+
+static void parser_init(struct stf_parser *parser)
+{
+    stf_context_init(&parser->stf, &kParserCallbacks, parser);
+
+    parser->stf.counters.timing = collect_stats;
+}
+
+static void parser_free(struct stf_parser *parser)
+{
+    free(parser->described);
+    output_free(&parser->output);
+    stf_context_destroy(&parser->stf);
+    free(parser);
+}
+
+static void parse_stf(struct stf_parser *parser)
+{
+    int result;
+
+    // Streaming has to look ahead for categories after items.
+    if (parser->output.format == OUTPUT_STREAM && parser->whole == NULL)
+        input_slurp(&parser->stf.input, &parser->file);
+
+    result = stf_parse(&parser->stf);
+
+    parser_stats(parser);
+
+    if (result != 0)
+        errx(EXIT_FAILURE, "%s", parser->stf.error);
+}
+
+// Parse part of a mapped file, carrying on from where the last part ended.
+static void parse_stf_range(struct stf_parser *parser, const struct stf_input *file, size_t offset, size_t len, bool boundary)
+{
+    struct stf_input *input = &parser->stf.input;
+
+    memset(input, 0, sizeof *input);
+
+    input->data      = file->data + offset;
+    input->len       = len;
+    input->base      = offset;
+    input->eof       = true;
+    input->boundary  = boundary;
+    input->counters  = &parser->stf.counters;
+
+    parse_stf(parser);
+}
+
+// With an index, only the items that might match the filters have to be
+// parsed, along with anything between items like headers and categories.
+static void parse_stf_indexed(struct stf_parser *parser, const struct stf_index *index)
+{
+    struct stf_input file = parser->stf.input;
+    uint32_t *hits = calloc(index->header.nitems + 1, sizeof *hits);
+    uint32_t required;
+    size_t end = 0;
+
+    if (hits == NULL)
+        err(EXIT_FAILURE, "failed to allocate index");
+
+    required = index_filters(index, parser->filters, hits);
+
+    parser->whole = &file;
+
+    // Every part except the last is followed by an item.
+    parser->stf.continues = true;
+
+    for (uint32_t i = 0; i < index->header.nitems; i++) {
+        const struct stf_index_item *item = &index->items[i];
+
+        if (item->flags & INDEX_ITEM_GAP)
+            parse_stf_range(parser, &file, end, item->offset - end, true);
+
+        if (hits[i] == required)
+            parse_stf_range(parser, &file, item->offset, item->len, true);
+
+        end = item->offset + item->len;
+    }
+
+    parse_stf_range(parser, &file, end, file.len - end, false);
+
+    parser->stf.input = file;
+    parser->whole     = NULL;
+    free(hits);
+}
+
+// Concatenated {STF} blocks are independent, except that the date format
+// carries over between them, and the items in a block are independent too.
+// They can be found quickly without parsing, then converted in parallel and
+// the output replayed in order.
+#define STF_JOB_SIZE (1 << 20)
+
+struct stf_job {
+    const struct stf_input *input;  // The file this is part of.
+    size_t source;
+    size_t offset;
+    size_t len;
+    int dateformat;     // The date format in effect at the start.
+    bool continued;     // Whether this job starts part way through a block.
+    bool continues;     // Whether the next job continues the last block.
+    struct stf_buffer events;
+    char *comments;
+    size_t commentslen;
+    char *quarantine;
+    size_t quarantinelen;
+    bool done;
+};
+
+// Every file is converted with it's own contexts, so the date format starts
+// out as the default in each one.
+struct stf_source {
+    struct stf_input input;
+    struct stf_file file;
+    size_t first;       // Index of the first job for this file.
+    size_t count;
+    size_t finished;    // Number of those jobs done.
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct stf_source *sources;
+    struct stf_job *jobs;
+    size_t count;       // Total number of jobs.
+    size_t next;        // Next job to be started.
+    size_t written;     // Number of jobs written to stdout.
+    size_t window;      // Maximum number of jobs finished but not written.
+    struct stf_output *output;
+    const struct stf_filter *filters;
+    const struct stf_projection *projection;
+    const struct stf_projection *filtered;
+    bool lazy;
+    bool recover;
+    bool quarantine;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static struct stf_job *add_stf_job(struct stf_job **jobs, size_t *count, size_t offset, int dateformat)
+{
+    if ((*jobs = realloc(*jobs, ++*count * sizeof **jobs)) == NULL)
+        err(EXIT_FAILURE, "failed to allocate jobs");
+
+    memset(&(*jobs)[*count - 1], 0, sizeof **jobs);
+    (*jobs)[*count - 1].offset      = offset;
+    (*jobs)[*count - 1].dateformat  = dateformat;
+    return &(*jobs)[*count - 1];
+}
+
+// Each job ends where the next one starts.
+static void end_stf_jobs(struct stf_job *jobs, size_t count, size_t len)
+{
+    for (size_t i = 0; i < count; i++) {
+        jobs[i].len = (i + 1 < count ? jobs[i + 1].offset : len) - jobs[i].offset;
+        jobs[i].continues = i + 1 < count && jobs[i + 1].continued;
+    }
+}
+
+// When recovering, anything can be skipped, including {d} tags and items
+// that the tags alone would say were safe to split at. So the parser itself
+// finds the blocks, just indexing the items because only it's state matters.
+// A broken header is left in the job before it, which skips it the same way.
+struct stf_prescan {
+    struct stf_job **jobs;
+    struct stf_job *job;
+    size_t count;
+    bool inblock;
+};
+
+static int prescan_header(struct stf_context *ctx, const char *timestamp)
+{
+    struct stf_prescan *prescan = ctx->arg;
+
+    (void) timestamp;
+
+    // The first job always starts at the beginning.
+    if (prescan->inblock)
+        prescan->job = add_stf_job(prescan->jobs, &prescan->count, ctx->input.base + ctx->input.mark, ctx->dateformat);
+
+    prescan->inblock = true;
+    return 0;
+}
+
+static int prescan_item_begin(struct stf_context *ctx)
+{
+    struct stf_prescan *prescan = ctx->arg;
+
+    // Start a new job if this one is big enough.
+    if (ctx->offset - prescan->job->offset >= STF_JOB_SIZE) {
+        prescan->job = add_stf_job(prescan->jobs, &prescan->count, ctx->offset, ctx->dateformat);
+        prescan->job->continued = true;
+    }
+
+    return 0;
+}
+
+static const struct stf_callbacks kPrescanCallbacks = {
+    .on_stf_header  = prescan_header,
+    .on_item_begin  = prescan_item_begin,
+};
+
+static size_t follow_stf_blocks(struct stf_input *input, struct stf_job **jobs)
+{
+    struct stf_prescan prescan = { .jobs = jobs };
+    struct stf_context ctx;
+
+    stf_context_init(&ctx, &kPrescanCallbacks, &prescan);
+
+    ctx.lazy    = true;
+    ctx.recover = true;
+
+    *jobs = NULL;
+    prescan.job = add_stf_job(jobs, &prescan.count, 0, ctx.dateformat);
+
+    // Nothing here can stop it, and any other errors are reported when the
+    // jobs are parsed.
+    stf_parse_buffer(&ctx, input->data, input->len);
+    stf_context_destroy(&ctx);
+
+    end_stf_jobs(*jobs, prescan.count, input->len);
+    return prescan.count;
+}
+
+// Split the input into jobs at each {STF} header, the first job also includes
+// anything before the first header. Large blocks are split again at any {I}
+// outside an item or category, categories defined after that are still
+// collected into the block when the jobs are written.
+static size_t find_stf_blocks(struct stf_input *input, struct stf_job **jobs)
+{
+    struct stf_chunk chunk;
+    struct stf_job *job;
+    size_t count = 0;
+    int dateformat = 1;
+    bool inblock = false;
+    bool initem = false;
+    bool incategory = false;
+    char value[32];
+
+    *jobs = NULL;
+    job = add_stf_job(jobs, &count, 0, dateformat);
+
+    while (stf_read_chunk(input, &chunk) != -1) {
+        // The tag data starts after the open tag character.
+        size_t offset = chunk.tag.data - 1 - input->data;
+
+        switch (chunk.id) {
+            case STF_TAG_STF:
+                // The first job always starts at the beginning.
+                if (inblock)
+                    job = add_stf_job(jobs, &count, offset, dateformat);
+
+                inblock     = true;
+                initem      = false;
+                incategory  = false;
+                break;
+            case STF_TAG_DATEFMT:
+                // Invalid formats will be reported when the block is parsed.
+                snprintf(value, sizeof value, "%.*s", STF_SLICE_FMT(chunk.value));
+
+                if (strtoul(value, NULL, 10) >= 1 && strtoul(value, NULL, 10) <= 12)
+                    dateformat = strtoul(value, NULL, 10);
+                break;
+            case STF_TAG_ITEM:
+                if (initem || incategory)
+                    break;
+
+                // Start a new job if this one is big enough.
+                if (inblock && offset - job->offset >= STF_JOB_SIZE) {
+                    job = add_stf_job(jobs, &count, offset, dateformat);
+                    job->continued = true;
+                }
+
+                initem = true;
+                break;
+            case STF_TAG_END_ITEM:
+                initem = false;
+                break;
+            case STF_TAG_CATEGORY:
+                if (!initem)
+                    incategory = true;
+                break;
+            case STF_TAG_END_CATEGORY:
+                if (!initem)
+                    incategory = false;
+                break;
+            default:
+                break;
+        }
+    }
+
+    end_stf_jobs(*jobs, count, input->len);
+    return count;
+}
+
+static void run_stf_job(struct stf_job *job, size_t index)
+{
+    struct stf_parser *parser = calloc(1, sizeof *parser);
+
+    if (parser == NULL)
+        err(EXIT_FAILURE, "failed to allocate parser");
+
+    parser_init(parser);
+
+    // The input is just a view of part of the buffer.
+    parser->stf.input.data      = job->input->data + job->offset;
+    parser->stf.input.base      = job->offset;
+    parser->stf.input.len       = job->len;
+    parser->stf.input.eof       = true;
+    parser->stf.input.boundary  = index + 1 < pool.count && pool.jobs[index + 1].input == job->input;
+
+    parser->output.format   = pool.output->format;
+    parser->output.encoding = pool.output->encoding;
+    parser->output.jsonc    = pool.output->jsonc;
+    parser->output.events   = &job->events;
+    parser->comments        = open_memstream(&job->comments, &job->commentslen);
+    parser->file.name       = pool.sources[job->source].file.name;
+    parser->filters         = pool.filters;
+    parser->projection      = pool.projection;
+    parser->filtered        = pool.filtered;
+    parser->stf.lazy        = pool.lazy;
+    parser->stf.recover     = pool.recover;
+    parser->stf.dateformat  = job->dateformat;
+    parser->stf.continues   = job->continues;
+
+    if (pool.quarantine)
+        parser->quarantine = open_memstream(&job->quarantine, &job->quarantinelen);
+
+    // Pick up where the previous job left off.
+    if (job->continued)
+        parser->stf.state = STF_STATE_ROOT;
+
+    parse_stf(parser);
+
+    if (parser->quarantine)
+        fclose(parser->quarantine);
+
+    fclose(parser->comments);
+    parser_free(parser);
+}
+
+static void *stf_worker(void *arg)
+{
+    size_t index;
+
+    (void) arg;
+
+    pthread_mutex_lock(&pool.lock);
+
+    while (true) {
+        // Don't get too far ahead of the output.
+        while (pool.next < pool.count && pool.next >= pool.written + pool.window)
+            pthread_cond_wait(&pool.cond, &pool.lock);
+
+        if (pool.next >= pool.count)
+            break;
+
+        index = pool.next++;
+
+        pthread_mutex_unlock(&pool.lock);
+
+        run_stf_job(&pool.jobs[index], index);
+
+        pthread_mutex_lock(&pool.lock);
+
+        pool.jobs[index].done = true;
+        pool.sources[pool.jobs[index].source].finished++;
+
+        pthread_cond_broadcast(&pool.cond);
+    }
+
+    stats_merge();
+
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+static void write_stf_job(struct stf_parser *parser, struct stf_job *job)
+{
+    pthread_mutex_lock(&pool.lock);
+
+    while (!job->done)
+        pthread_cond_wait(&pool.cond, &pool.lock);
+
+    pthread_mutex_unlock(&pool.lock);
+
+    fwrite(job->comments, 1, job->commentslen, parser->comments);
+    output_replay(&parser->output, &job->events, parser->output.format == OUTPUT_STREAM
+                                              && !job->continued
+                                              && categories_follow_items(job->input, job->offset));
+
+    if (parser->quarantine)
+        fwrite(job->quarantine, 1, job->quarantinelen, parser->quarantine);
+
+    free(job->comments);
+    free(job->quarantine);
+    buffer_free(&job->events);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.written++;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Find the next file to write when they're written as they finish. If the
+// workers are waiting for something to be written first, it has to be the
+// earliest one, because only that is sure to have all it's jobs started.
+static struct stf_source *next_stf_source(struct stf_source *sources, size_t count, const bool *written)
+{
+    struct stf_source *source = NULL;
+
+    pthread_mutex_lock(&pool.lock);
+
+    while (source == NULL) {
+        for (size_t i = 0; i < count && source == NULL; i++) {
+            if (!written[i] && sources[i].finished == sources[i].count)
+                source = &sources[i];
+        }
+
+        if (source == NULL && pool.next < pool.count && pool.next >= pool.written + pool.window) {
+            for (size_t i = 0; i < count && source == NULL; i++) {
+                if (!written[i])
+                    source = &sources[i];
+            }
+        }
+
+        if (source == NULL)
+            pthread_cond_wait(&pool.cond, &pool.lock);
+    }
+
+    pthread_mutex_unlock(&pool.lock);
+    return source;
+}
+
+// The first file is already open in the parser, the others are opened here.
+static void parse_stf_parallel(struct stf_parser *parser, char **filenames, int count, int nthreads, bool unordered)
+{
+    pthread_t *threads = calloc(nthreads, sizeof *threads);
+    struct stf_source *sources = calloc(count, sizeof *sources);
+    bool *written = calloc(count, sizeof *written);
+
+    if (threads == NULL || sources == NULL || written == NULL)
+        err(EXIT_FAILURE, "failed to allocate threads");
+
+    pool.sources = sources;
+    pool.output  = &parser->output;
+    pool.filters    = parser->filters;
+    pool.projection = parser->projection;
+    pool.filtered   = parser->filtered;
+    pool.lazy       = parser->stf.lazy;
+    pool.recover    = parser->stf.recover;
+    pool.quarantine = parser->quarantine != NULL;
+    pool.window  = nthreads * 4;
+
+    sources[0].input = parser->stf.input;
+    sources[0].file  = parser->file;
+
+    for (int i = 0; i < count; i++) {
+        struct stf_source *source = &sources[i];
+        struct stf_job *jobs;
+
+        if (i > 0)
+            input_open(&source->input, &source->file, filenames[i], false);
+
+        // The whole input is needed to find the blocks.
+        source->input.counters = &parser->stf.counters;
+
+        input_slurp(&source->input, &source->file);
+
+        source->first = pool.count;
+        source->count = pool.recover
+                            ? follow_stf_blocks(&source->input, &jobs)
+                            : find_stf_blocks(&source->input, &jobs);
+
+        if ((pool.jobs = realloc(pool.jobs, (pool.count + source->count) * sizeof *pool.jobs)) == NULL)
+            err(EXIT_FAILURE, "failed to allocate jobs");
+
+        for (size_t j = 0; j < source->count; j++) {
+            jobs[j].input   = &source->input;
+            jobs[j].source  = i;
+            pool.jobs[pool.count++] = jobs[j];
+        }
+
+        free(jobs);
+    }
+
+    // Finding the blocks read every chunk, but they're counted when they're
+    // parsed.
+    memset(parser->stf.counters.chunks, 0, sizeof parser->stf.counters.chunks);
+    memset(parser->stf.counters.bytes, 0, sizeof parser->stf.counters.bytes);
+
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, stf_worker, NULL) != 0) {
+            errx(EXIT_FAILURE, "failed to create worker thread");
+        }
+    }
+
+    // Write the results in their original order as they complete, or each
+    // file as soon as all of it is finished.
+    if (unordered) {
+        for (int i = 0; i < count; i++) {
+            struct stf_source *source = next_stf_source(sources, count, written);
+
+            for (size_t j = 0; j < source->count; j++)
+                write_stf_job(parser, &pool.jobs[source->first + j]);
+
+            written[source - sources] = true;
+        }
+    } else {
+        for (size_t i = 0; i < pool.count; i++)
+            write_stf_job(parser, &pool.jobs[i]);
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // The first file is closed with the parser.
+    parser->stf.input = sources[0].input;
+    parser->file      = sources[0].file;
+
+    for (int i = 1; i < count; i++)
+        input_close(&sources[i].input, &sources[i].file);
+
+    free(pool.jobs);
+    free(sources);
+    free(written);
+    free(threads);
+}
+
+// Without threads, the files after the first are converted one at a time
+// with a new context, and the output just carries on.
+static void parse_stf_files(struct stf_parser *parser, char **filenames, int count)
+{
+    bool lazy = parser->stf.lazy;
+    bool recover = parser->stf.recover;
+
+    parse_stf(parser);
+
+    for (int i = 1; i < count; i++) {
+        input_close(&parser->stf.input, &parser->file);
+        stf_context_destroy(&parser->stf);
+        parser_init(parser);
+
+        parser->stf.lazy    = lazy;
+        parser->stf.recover = recover;
+
+        input_open(&parser->stf.input, &parser->file, filenames[i], false);
+        parse_stf(parser);
+    }
+}
+
+// Print the counters for -S to stderr, after everything else is finished.
+static void print_stats(bool json, uint64_t elapsed, size_t size)
+{
+    const char *stages[] = { "tokenizing", "links", "dates", "formatting" };
+    const uint64_t times[] = { totals.tokenizing, totals.links, totals.dates, totals.formatting };
+    const char *growth[] = { "input", "buffers", "arena", "symbols" };
+    const uint64_t counts[] = { totals.inputgrowth, totals.buffergrowth, totals.arenablocks, totals.symbolgrowth };
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    if (json) {
+        fprintf(stderr, "{\"seconds\":%.6f,\"bytes\":%zu,\"maxrss\":%ld,\"stages\":{", elapsed / 1e9, size, usage.ru_maxrss);
+
+        for (size_t i = 0; i < sizeof stages / sizeof *stages; i++)
+            fprintf(stderr, "%s\"%s\":%.6f", i ? "," : "", stages[i], times[i] / 1e9);
+
+        fprintf(stderr, "},\"tags\":{");
+
+        for (int tag = 0, first = 1; tag < STF_TAG_COUNT; tag++) {
+            if (totals.chunks[tag] == 0)
+                continue;
+
+            fprintf(stderr, "%s\"%s\":{\"chunks\":%" PRIu64 ",\"bytes\":%" PRIu64 "}",
+                    first ? "" : ",", kStfTagNames[tag], totals.chunks[tag], totals.bytes[tag]);
+            first = 0;
+        }
+
+        fprintf(stderr, "},\"growth\":{");
+
+        for (size_t i = 0; i < sizeof growth / sizeof *growth; i++)
+            fprintf(stderr, "%s\"%s\":%" PRIu64, i ? "," : "", growth[i], counts[i]);
+
+        fprintf(stderr, "}}\n");
+        return;
+    }
+
+    fprintf(stderr, "%-12s %10.3fs %10.1f MB/s\n", "total", elapsed / 1e9, elapsed ? size / 1048576.0 / (elapsed / 1e9) : 0);
+
+    for (size_t i = 0; i < sizeof stages / sizeof *stages; i++)
+        fprintf(stderr, "%-12s %10.3fs %10.1f%%\n", stages[i], times[i] / 1e9, elapsed ? 100.0 * times[i] / elapsed : 0);
+
+    fprintf(stderr, "%-12s %10s %14s\n", "tag", "chunks", "bytes");
+
+    for (int tag = 0; tag < STF_TAG_COUNT; tag++) {
+        char name[8];
+
+        if (totals.chunks[tag] == 0)
+            continue;
+
+        snprintf(name, sizeof name, "{%s}", kStfTagNames[tag]);
+        fprintf(stderr, "%-12s %10" PRIu64 " %14" PRIu64 "\n", name, totals.chunks[tag], totals.bytes[tag]);
+    }
+
+    fprintf(stderr, "%-12s %10s\n", "growth", "count");
+
+    for (size_t i = 0; i < sizeof growth / sizeof *growth; i++)
+        fprintf(stderr, "%-12s %10" PRIu64 "\n", growth[i], counts[i]);
+
+    fprintf(stderr, "%-12s %10ld KB\n", "peak memory", usage.ru_maxrss);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-slnJuwxr] [-j threads] [-f filter] [-p fields] [-i checkpoint] [-q quarantine] [-o format] [-S format] [transfer.stf ...]\n", name);
+    fprintf(stderr, "  -s   Stream items to stdout as they're parsed.\n");
+    fprintf(stderr, "  -l   Print one category or item per line (JSON Lines).\n");
+    fprintf(stderr, "  -j   Convert files, {STF} blocks and items in parallel.\n");
+    fprintf(stderr, "  -n   Link to categories by id, with names only in the first link.\n");
+    fprintf(stderr, "  -J   Use json-c to format the output.\n");
+    fprintf(stderr, "  -u   With threads, write each file as soon as it's converted.\n");
+    fprintf(stderr, "  -f   Only print items matching a filter, can be repeated.\n");
+    fprintf(stderr, "       category:NAME   The item is assigned to NAME.\n");
+    fprintf(stderr, "       text:REGEX      The item text matches REGEX.\n");
+    fprintf(stderr, "       NAME<DATE       The date category NAME is before DATE.\n");
+    fprintf(stderr, "       NAME>DATE       The date category NAME is after DATE.\n");
+    fprintf(stderr, "                       DATE can be a timestamp or 'now'.\n");
+    fprintf(stderr, "  -w   Follow a growing file, printing new items as lines.\n");
+    fprintf(stderr, "  -x   Keep an index next to the file, so filters can skip items.\n");
+    fprintf(stderr, "  -i   Save a checkpoint to this file, and start from it next time.\n");
+    fprintf(stderr, "  -p   Only print these comma separated item fields, can be repeated.\n");
+    fprintf(stderr, "       text, note      The item text or note.\n");
+    fprintf(stderr, "       categories      All category links.\n");
+    fprintf(stderr, "       category:NAME   Links to the category NAME.\n");
+    fprintf(stderr, "       definitions     Also print category definitions.\n");
+    fprintf(stderr, "  -r   Skip items, categories and blocks that can't be parsed.\n");
+    fprintf(stderr, "  -q   Skip anything that can't be parsed, and save it to this file.\n");
+    fprintf(stderr, "  -o   Write the output as json, compact json or cbor.\n");
+    fprintf(stderr, "  -S   Print statistics to stderr, as text or json.\n");
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    int output;
+    int encoding;
+    int threads;
+    bool jsonc;
+    char *document;
+    size_t documentlen;
+    struct stf_parser *parser;
+    struct stf_filter *filters;
+    struct stf_projection *projection;
+    struct stf_projection filtered;
+    struct stf_checkpoint checkpoint;
+    const char *checkpointfile;
+    const char *quarantinefile;
+    struct stf_index index;
+    char *indexfile;
+    bool indexed;
+    bool follow;
+    bool unordered;
+    bool normalized;
+    bool recover;
+    bool statsjson;
+    int nfiles;
+    uint64_t started;
+
+    output  = OUTPUT_DOCUMENT;
+    encoding = ENCODING_JSON;
+    follow  = false;
+    unordered = false;
+    normalized = false;
+    recover = false;
+    indexed = false;
+    statsjson = false;
+    indexfile = NULL;
+    threads = 0;
+    jsonc   = false;
+    filters = NULL;
+    projection = NULL;
+    checkpointfile = NULL;
+    quarantinefile = NULL;
+
+    while ((opt = getopt(argc, argv, "slnj:Juwxrf:p:i:q:o:S:h")) != -1) {
+        switch (opt) {
+            case 's':
+                output = OUTPUT_STREAM;
+                break;
+            case 'l':
+                output = OUTPUT_LINES;
+                break;
+            case 'n':
+                normalized = true;
+                break;
+            case 'j':
+                threads = strtoul(optarg, NULL, 10);
+                break;
+            case 'J':
+                jsonc = true;
+                break;
+            case 'u':
+                unordered = true;
+                break;
+            case 'f':
+                add_filter(&filters, optarg);
+                break;
+            case 'i':
+                checkpointfile = optarg;
+                break;
+            case 'w':
+                follow = true;
+                break;
+            case 'r':
+                recover = true;
+                break;
+            case 'q':
+                quarantinefile = optarg;
+                recover = true;
+                break;
+            case 'x':
+                indexed = true;
+                break;
+            case 'o':
+                if (strcmp(optarg, "json") == 0) {
+                    encoding = ENCODING_JSON;
+                } else if (strcmp(optarg, "compact") == 0) {
+                    encoding = ENCODING_COMPACT;
+                } else if (strcmp(optarg, "cbor") == 0) {
+                    encoding = ENCODING_CBOR;
+                } else {
+                    errx(EXIT_FAILURE, "the output can only be json, compact or cbor");
+                }
+                break;
+            case 'S':
+                if (strcmp(optarg, "text") != 0 && strcmp(optarg, "json") != 0)
+                    errx(EXIT_FAILURE, "statistics can only be printed as text or json");
+
+                collect_stats = true;
+                statsjson     = strcmp(optarg, "json") == 0;
+                break;
+            case 'p':
+                if (projection == NULL && (projection = calloc(1, sizeof *projection)) == NULL)
+                    err(EXIT_FAILURE, "failed to allocate projection");
+
+                add_projection(projection, optarg);
+                break;
+            case 'h':
+                usage(*argv);
+                return 0;
+            default:
+                usage(*argv);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (jsonc && encoding == ENCODING_CBOR)
+        errx(EXIT_FAILURE, "json-c can't be used to write cbor");
+
+    // Each thread and checkpoint would number the categories differently.
+    if (normalized && (threads > 1 || checkpointfile))
+        errx(EXIT_FAILURE, "category ids can't be used with threads or checkpoints");
+
+    // With no files, stdin is converted.
+    nfiles = argc - optind ? argc - optind : 1;
+
+    if (nfiles > 1 && (follow || checkpointfile || indexed))
+        errx(EXIT_FAILURE, "checkpoints, indexes and -w can only be used with one file");
+
+    // Nothing is printed until a document is finished, so print lines
+    // instead when following a file.
+    if (follow) {
+        if (optind == argc)
+            errx(EXIT_FAILURE, "a file is needed to follow");
+
+        if (threads > 1)
+            errx(EXIT_FAILURE, "threads can't be used while following a file");
+
+        output = OUTPUT_LINES;
+    }
+
+    started = stats_clock();
+
+    if ((parser = calloc(1, sizeof *parser)) == NULL)
+        err(EXIT_FAILURE, "failed to allocate parser");
+
+    parser_init(parser);
+
+    // Read from the specified file, or stdin.
+    input_open(&parser->stf.input, &parser->file, argv[optind], follow);
+
+    parser->output.format   = output;
+    parser->output.encoding = encoding;
+    parser->output.jsonc    = jsonc;
+    parser->output.out      = stdout;
+    parser->comments        = stderr;
+    parser->filters         = filters;
+    parser->projection      = projection;
+    parser->normalized      = normalized;
+    parser->stf.recover     = recover;
+
+    if (quarantinefile && (parser->quarantine = fopen(quarantinefile, "a")) == NULL)
+        err(EXIT_FAILURE, "failed to open %s", quarantinefile);
+
+    parser->file.idle       = parser_idle;
+    parser->file.idlearg    = parser;
+
+    memset(&filtered, 0, sizeof filtered);
+
+    for (struct stf_filter *filter = filters; filter; filter = filter->next) {
+        if (filter->type == FILTER_TEXT) {
+            filtered.text = true;
+        } else {
+            add_projection_link(&filtered, filter->name);
+        }
+    }
+
+    // If not everything is used, items are only decoded as far as necessary.
+    parser->filtered = &filtered;
+    parser->stf.lazy = filters || projection;
+
+    // A document isn't written until it's complete, in case of errors.
+    if (output == OUTPUT_DOCUMENT)
+        parser->output.out = open_memstream(&document, &documentlen);
+
+    if (checkpointfile) {
+        struct stat st;
+
+        if (threads > 1)
+            errx(EXIT_FAILURE, "checkpoints can't be used with threads");
+
+        if (fstat(parser->file.fd, &st) != 0 || !S_ISREG(st.st_mode))
+            errx(EXIT_FAILURE, "checkpoints can only be used with a regular file");
+
+        memset(&checkpoint, 0, sizeof checkpoint);
+
+        checkpoint.filename = checkpointfile;
+        parser->checkpoint  = &checkpoint;
+
+        // Carry on from the end of the last conversion.
+        if (load_checkpoint(&checkpoint, &parser->file)) {
+            input_seek(&parser->stf.input, &parser->file, checkpoint.offset);
+
+            parser->stf.state       = STF_STATE_ROOT;
+            parser->stf.dateformat  = checkpoint.dateformat;
+            parser->output.blocks   = checkpoint.block;
+
+            output_begin_stf(&parser->output, checkpoint.timestamp, parser_categories_follow(parser));
+        }
+    }
+
+    if (indexed) {
+        struct stat st;
+
+        if (optind == argc || !parser->file.mapped)
+            errx(EXIT_FAILURE, "an index can only be used with a regular file");
+
+        if (threads > 1 || checkpointfile || follow)
+            errx(EXIT_FAILURE, "an index can't be used with threads, checkpoints or -w");
+
+        if (asprintf(&indexfile, "%s.stfidx", argv[optind]) == -1 || fstat(parser->file.fd, &st) != 0)
+            err(EXIT_FAILURE, "failed to find index for %s", argv[optind]);
+
+        // If there's no usable index, every item is parsed and added to a
+        // new one.
+        if (!load_index(&index, indexfile, &st)) {
+            parser->index    = &index;
+            parser->stf.lazy = false;
+        }
+    }
+
+    if (threads > 1) {
+        parse_stf_parallel(parser, argv + optind, nfiles, threads, unordered);
+    } else if (indexed && !parser->index) {
+        parse_stf_indexed(parser, &index);
+    } else {
+        parse_stf_files(parser, argv + optind, nfiles);
+    }
+
+    output_finish(&parser->output);
+
+    if (checkpointfile)
+        save_checkpoint(&checkpoint, &parser->file);
+
+    if (parser->index)
+        save_index(&index, indexfile);
+
+    if (indexed)
+        free_index(&index);
+
+    free(indexfile);
+
+    if (output == OUTPUT_DOCUMENT) {
+        fclose(parser->output.out);
+        fwrite(document, 1, documentlen, stdout);
+        free(document);
+    }
+
+    input_close(&parser->stf.input, &parser->file);
+
+    if (parser->quarantine && fclose(parser->quarantine) != 0)
+        err(EXIT_FAILURE, "failed to write %s", quarantinefile);
+
+    // Everything has been written now.
+    if (collect_stats) {
+        parser_stats(parser);
+        stats_merge();
+        print_stats(statsjson, stats_clock() - started, totals.inputbytes);
+    }
+
+    free_filters(filters);
+    free_projection(&filtered);
+
+    if (projection) {
+        free_projection(projection);
+        free(projection);
     }
 
-    printf("%s\n", json_object_to_json_string_ext(root, JSON_C_TO_STRING_PRETTY));
-    json_object_put(root);
+    parser_free(parser);
     return 0;
 }